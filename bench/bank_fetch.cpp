@@ -0,0 +1,66 @@
+//microbenchmark: instruction fetch throughput from switchable rom banks.
+//switches through every bank of a 512k mbc1 image and reads 0x4000 - 0x7FFF
+//through the cpu's bus, the mmu handlers, and by asking the mapper for the bank
+//on every read, as the mmu did before the bank base pointer was cached.
+//
+//  make bank_bench && ./bank_bench [passes]
+
+#include "../src/mmu.hpp"
+#include "../src/bus.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+uint8_t g_polled_actions = 0x0F;
+uint8_t g_polled_directions = 0x0F;
+
+static const int ROM_BANKS = 32;
+
+template<class Fetch>
+static void run(const char* name, mmu& mem, int passes, Fetch fetch) {
+
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int pass = 0; pass < passes; pass++) {
+        for (int bank = 1; bank < ROM_BANKS; bank++) {
+            mem.ld(bank, 0x2000);
+            for (uint32_t address = 0x4000; address <= 0x7FFF; address++) {
+                sum += fetch(address);
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double bytes = (double)passes * (ROM_BANKS - 1) * 0x4000;
+    printf("%-10s %8.1f MB/s  (checksum %08x)\n", name, bytes / seconds / 1e6, sum);
+}
+
+int main(int argc, char* argv[]) {
+
+    int passes = (argc > 1) ? atoi(argv[1]) : 200;
+
+    std::vector<uint8_t> rom(ROM_BANKS * 0x4000);
+    for (size_t i = 0; i < rom.size(); i++) {
+        rom[i] = (uint8_t)(i * 7 + (i >> 14));
+    }
+    rom[0x147] = 0x01; //mbc1
+    rom[0x148] = 0x04; //512k
+
+    mmu* mem = new mmu();
+    mem->bootRomEnabled = false;
+    mem->insert_cartridge(rom_image::from_bytes(rom));
+
+    mmu_bus bus(*mem);
+
+    run("bus", *mem, passes, [&](uint16_t address) { return bus.rd(address); });
+    run("mmu", *mem, passes, [&](uint16_t address) { return mem->rd(address); });
+    run("per-read", *mem, passes, [&](uint16_t address) {
+        return mem->cart.romBank[(address - 0x4000) + mem->mbc->high_rom_bank() * 0x4000];
+    });
+
+    delete mem;
+    return 0;
+}
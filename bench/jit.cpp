@@ -0,0 +1,169 @@
+//benchmark: the jit against the interpreter on the same rom code.
+//a small rom copies a rom table into wram, runs a checksum over it and calls a
+//subroutine, in a loop, with the lcd on. both machines run the same number of
+//frames through the same loop as main.cpp (timer off, no input); the registers
+//and wram have to come out identical, then the time each took is compared.
+//
+//  make JIT=1 jit_bench && ./jit_bench [frames]
+
+#include "../src/cpu.hpp"
+#include "../src/ppu.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#ifndef CPU_JIT
+#error "build with make JIT=1 jit_bench"
+#endif
+
+uint8_t g_polled_actions = 0x0F;
+uint8_t g_polled_directions = 0x0F;
+
+static const int CYCLES_PER_FRAME = 70224;
+
+static std::vector<uint8_t> make_rom() {
+
+    std::vector<uint8_t> rom(0x8000, 0x00);
+
+    static const uint8_t code[] = {
+        0x31, 0xFF, 0xDF,       //      LD SP,0xDFFF
+        0x3E, 0x91, 0xE0, 0x40, //      LD A,0x91; LDH (LCDC),A
+                                //loop:
+        0x21, 0x00, 0x08,       //      LD HL,0x0800
+        0x11, 0x00, 0xC0,       //      LD DE,0xC000
+        0x01, 0x00, 0x01,       //      LD BC,0x0100
+        0x2A,                   //copy: LD A,(HL+)
+        0x12,                   //      LD (DE),A
+        0x13,                   //      INC DE
+        0x0B,                   //      DEC BC
+        0x78,                   //      LD A,B
+        0xB1,                   //      OR C
+        0x20, 0xF8,             //      JR NZ,copy
+        0x21, 0x00, 0xC0,       //      LD HL,0xC000
+        0x06, 0x00,             //      LD B,0
+        0x2A,                   //sum:  LD A,(HL+)
+        0x81,                   //      ADD A,C
+        0x4F,                   //      LD C,A
+        0xA8,                   //      XOR B
+        0x0F,                   //      RRCA
+        0x8B,                   //      ADC A,E
+        0x5F,                   //      LD E,A
+        0x05,                   //      DEC B
+        0x20, 0xF6,             //      JR NZ,sum
+        0xCD, 0x00, 0x02,       //      CALL sub
+        0xC3, 0x57, 0x01,       //      JP loop
+    };
+    static const uint8_t sub[] = {
+        0x79,                   //sub:  LD A,C
+        0xCB, 0x37,             //      SWAP A
+        0xE6, 0x0F,             //      AND 0x0F
+        0x83,                   //      ADD A,E
+        0xEA, 0x00, 0xC2,       //      LD (0xC200),A
+        0x3C,                   //      INC A
+        0xFE, 0x80,             //      CP 0x80
+        0x38, 0x02,             //      JR C,skip
+        0xD6, 0x40,             //      SUB 0x40
+        0xEA, 0x01, 0xC2,       //skip: LD (0xC201),A
+        0xC9,                   //      RET
+    };
+
+    rom[0x100] = 0xC3; rom[0x101] = 0x50; rom[0x102] = 0x01; //JP 0x0150
+    std::copy(code, code + sizeof(code), rom.begin() + 0x150);
+    std::copy(sub, sub + sizeof(sub), rom.begin() + 0x200);
+
+    for (int i = 0; i < 0x100; i++) {
+        rom[0x800 + i] = (uint8_t)(i * 37 + 11);
+    }
+    return rom;
+}
+
+struct machine {
+
+    mmu mem;
+    ppu graphics;
+    cpu gb;
+
+    machine(std::shared_ptr<const rom_image> image) : graphics(mem), gb(mem) {
+
+        mem.connect_ppu(&graphics);
+
+        gb.peripheral_tick = [this](int cycles) { tick(cycles); };
+        gb.peripheral_slack = [this]() { return (gb.IME && (mem.rd(0xFFFF) & 0x3) && (graphics.LCDC & 0x80)) ? graphics.cycles_until_interrupt() - 1 : 0x7FFFFFFF; };
+        gb.peripheral_catch_up = [this](int cycles, int instructions) {
+            mem.div += instructions;
+            if (graphics.LCDC & 0x80) {
+                graphics.advance(cycles);
+            }
+        };
+
+        mem.insert_cartridge(image);
+        gb.fast_boot = true;
+        gb.reset();
+    }
+
+    //tick_peripherals without the timer, which the rom leaves off
+    void tick(int cycles) {
+        mem.div++;
+        if (graphics.LCDC & 0x80) {
+            graphics.advance(cycles);
+        }
+    }
+
+    void run_frame(bool use_jit) {
+
+        int cycles_this_frame = 0;
+        while (cycles_this_frame < CYCLES_PER_FRAME) {
+            if (use_jit && gb.code_cache.starts_block(gb.PC)) {
+                int jit_cycles = gb.code_jit.run(gb, CYCLES_PER_FRAME - cycles_this_frame);
+                if (jit_cycles) {
+                    cycles_this_frame += jit_cycles;
+                    continue;
+                }
+            }
+            cycles_this_frame += gb.execute();
+            tick(gb.cycles);
+        }
+    }
+};
+
+static double run(machine& m, int frames, bool use_jit) {
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        m.run_frame(use_jit);
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+
+    int frames = (argc > 1) ? atoi(argv[1]) : 3000;
+
+    std::shared_ptr<const rom_image> image = rom_image::from_bytes(make_rom());
+
+    machine* interpreted = new machine(image);
+    machine* translated = new machine(image);
+
+    double interpreter_seconds = run(*interpreted, frames, false);
+    double jit_seconds = run(*translated, frames, true);
+
+    bool same = interpreted->gb.PC == translated->gb.PC && interpreted->gb.AF == translated->gb.AF &&
+                interpreted->gb.BC == translated->gb.BC && interpreted->gb.DE == translated->gb.DE &&
+                interpreted->gb.HL == translated->gb.HL && interpreted->gb.SP == translated->gb.SP;
+    for (uint16_t address = 0xC000; address < 0xE000 && same; address++) {
+        same = interpreted->mem.rd(address) == translated->mem.rd(address);
+    }
+
+    double emulated = (double)frames * CYCLES_PER_FRAME;
+    printf("interpreter %8.1f MHz  (%.3f s)\n", emulated / interpreter_seconds / 1e6, interpreter_seconds);
+    printf("jit         %8.1f MHz  (%.3f s, %llu blocks, %llu links)  %.2fx\n", emulated / jit_seconds / 1e6, jit_seconds,
+           (unsigned long long)translated->gb.code_jit.blocks_translated, (unsigned long long)translated->gb.code_jit.links_patched,
+           interpreter_seconds / jit_seconds);
+    printf("state %s\n", same ? "identical" : "DIFFERENT");
+
+    delete interpreted;
+    delete translated;
+    return same ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+//microbenchmark: background and sprite rendering, render_scanline() for every
+//visible line of a frame over vram and oam filled with a fixed pattern, once with
+//each set of pixel kernels this cpu can run. prints the time per frame and a
+//checksum of the screen buffer, which has to be the same for every set.
+//
+//  make scanline_bench && ./scanline_bench [frames]
+
+#include "../src/mmu.hpp"
+#include "../src/ppu.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+uint8_t g_polled_actions = 0x0F;
+uint8_t g_polled_directions = 0x0F;
+
+static void run(ppu* graphics, const pixel_kernels* kernels, int frames) {
+
+    graphics->kernels = kernels;
+    graphics->invalidate_tiles();
+
+    uint32_t sum = 0;
+    double seconds = 0;
+
+    for (int frame = 0; frame < frames; frame++) {
+
+        graphics->SCX = frame;
+        graphics->SCY = frame >> 1;
+
+        for (int line = 0; line < GB_HEIGHT; line++) {
+
+            graphics->spritesFound = 10; //a full line of sprites, every other one flipped or behind the bg
+            for (int i = 0; i < 10; i++) {
+                graphics->addSprite(i, line + 16 - (i & 7), i * 17 + frame % 8, i * 13, (i * 0x30) & 0xF0);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            graphics->render_scanline(line);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        for (int i = 0; i < GB_WIDTH * GB_HEIGHT; i++) {
+            sum = sum * 31 + graphics->screenBuffer[i];
+        }
+    }
+
+    printf("render_scanline %-6s %8.2f us/frame  (%d frames, checksum %08x)\n", kernels->name, seconds / frames * 1e6, frames, sum);
+}
+
+int main(int argc, char* argv[]) {
+
+    int frames = (argc > 1) ? atoi(argv[1]) : 2000;
+
+    mmu* mem = new mmu();
+    ppu* graphics = new ppu(*mem);
+    mem->connect_ppu(graphics);
+
+    uint32_t seed = 1;
+    for (int i = 0; i < 0x2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        graphics->VRAM[i] = seed >> 16;
+    }
+
+    graphics->LCDC = 0xF3; //bg, window and 8x8 sprites on
+    graphics->BGP  = 0xE4;
+    graphics->OBP0 = 0xD2;
+    graphics->OBP1 = 0x1B;
+    graphics->WY   = 100;
+    graphics->WX   = 87;
+
+    static const char* const sets[] = {"scalar", "sse2", "avx2"};
+    for (const char* name : sets) {
+        if (const pixel_kernels* kernels = find_pixel_kernels(name)) {
+            run(graphics, kernels, frames);
+        }
+    }
+
+    delete graphics;
+    delete mem;
+    return 0;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "mmu.hpp"
+
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+
+//memory buses the cpu core can be built over (see basic_cpu in cpu.hpp).
+//every bus has rd/ld like the mmu, the cached IE & IF byte, a way to insert the
+//rom during initialize, reset() back to power on without going through rd/ld,
+//skip_boot_rom() for the state the boot rom leaves behind and memory(),
+//the mmu behind it or nullptr when there is none.
+//instrumented buses keep the cpu's decoder statistics, the others compile them out.
+
+
+//production bus: the page table lookup and hram are inline so the compiler can see
+//them, everything else goes to the mmu
+struct mmu_bus {
+
+    static const bool instrumented = false;
+
+    mmu& mem;
+
+    mmu_bus(mmu& shared_memory) : mem(shared_memory){};
+
+    mmu* memory() { return &mem; }
+
+    uint8_t interrupt_pending() const { return mem.interrupt_pending; }
+
+    uint8_t rd(uint16_t address) {
+        const uint8_t* page = mem.read_page[address >> 8];
+        if (page) {
+            return page[address & 0xFF];
+        }
+        if (address >= 0xFF80 && address <= 0xFFFE) {
+            return mem.HRAM[address - 0xFF80];
+        }
+        if (mem.dma_blocks(address)) {
+            return 0xFF;
+        }
+        return mem.rd(address);
+    }
+
+    void ld(uint8_t data, uint16_t address) {
+        uint8_t* page = mem.write_page[address >> 8];
+        if (page) {
+            page[address & 0xFF] = data;
+        } else if (address >= 0xFF80 && address <= 0xFFFE) {
+            mem.HRAM[address - 0xFF80] = data;
+        } else if (!mem.dma_blocks(address)) {
+            mem.ld(data, address);
+        }
+    }
+
+    void insert_cartridge(std::shared_ptr<const rom_image> rom) { mem.insert_cartridge(std::move(rom)); }
+    void reset() { mem.reset(); }
+    void skip_boot_rom() { mem.skip_boot_rom(); }
+};
+
+
+//tracing bus: counts every access and can log them, one line each
+struct trace_bus {
+
+    static const bool instrumented = true;
+
+    mmu_bus inner;
+
+    std::ostream* log = nullptr;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+
+    trace_bus(mmu& shared_memory) : inner(shared_memory){};
+
+    mmu* memory() { return inner.memory(); }
+
+    uint8_t interrupt_pending() const { return inner.interrupt_pending(); }
+
+    uint8_t rd(uint16_t address) {
+        uint8_t data = inner.rd(address);
+        reads++;
+        if (log) {
+            *log << "RD " << std::hex << address << " " << +data << "\n";
+        }
+        return data;
+    }
+
+    void ld(uint8_t data, uint16_t address) {
+        writes++;
+        if (log) {
+            *log << "LD " << std::hex << address << " " << +data << "\n";
+        }
+        inner.ld(data, address);
+    }
+
+    void insert_cartridge(std::shared_ptr<const rom_image> rom) { inner.insert_cartridge(std::move(rom)); }
+
+    void reset() {
+        inner.reset();
+        reads = writes = 0;
+    }
+
+    void skip_boot_rom() { inner.skip_boot_rom(); }
+};
+
+
+//flat 64k of ram with no mapping or io behaviour, for single step cpu tests
+struct flat_bus {
+
+    static const bool instrumented = true;
+
+    uint8_t ram[0x10000] = {0};
+
+    mmu* memory() { return nullptr; }
+
+    uint8_t interrupt_pending() const { return ram[0xFFFF] & ram[0xFF0F]; }
+
+    uint8_t rd(uint16_t address) { return ram[address]; }
+    void ld(uint8_t data, uint16_t address) { ram[address] = data; }
+
+    void insert_cartridge(std::shared_ptr<const rom_image> rom) {
+        std::copy(rom->data(), rom->data() + std::min<size_t>(rom->size(), 0x8000), ram);
+    }
+
+    void reset() { std::fill(ram + 0x8000, ram + 0x10000, 0); } //the rom stays
+    void skip_boot_rom() {} //no boot rom over the flat memory
+};
+
+
+//the cpu the emulator itself runs on, make BUS=trace swaps in the tracing bus
+template<class Bus> class basic_cpu;
+
+#ifdef CPU_TRACE_BUS
+typedef basic_cpu<trace_bus> cpu;
+#else
+typedef basic_cpu<mmu_bus> cpu;
+#endif
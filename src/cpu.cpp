@@ -1,69 +1,149 @@
 #include "cpu.hpp"
 #include "mmu.hpp"
 
-#include <fstream>
+#include <array>
+#include <utility>
 
-void cpu::initialize(std::string rom) {
-    
-    for (int i = 0; i < 0xFFFF; i++) {
-        mem.ld(0, i);
-    }
+#ifndef CPU_COMPUTED_GOTO
 
+//one handler per opcode, bodies come from opcodes.inc
+#define OP(code, ...) template<class Bus> void basic_cpu<Bus>::op_##code() { __VA_ARGS__ }
+#define CB(code, ...) template<class Bus> void basic_cpu<Bus>::cb_##code() { __VA_ARGS__ }
+#include "opcodes.inc"
 
-    PC = 0x0;
-    SP = 0xFFFE;
+template<class Bus>
+struct dispatch_tables {
+    typedef typename basic_cpu<Bus>::handler handler;
+
+    static constexpr handler base[256] = {
+        #define OP(code, ...) &basic_cpu<Bus>::op_##code,
+        #define ILLEGAL(code) &basic_cpu<Bus>::unknown_opcode,
+        #include "opcodes.inc"
+    };
+
+    static constexpr handler cb[256] = {
+        #define CB(code, ...) &basic_cpu<Bus>::cb_##code,
+        #include "opcodes.inc"
+    };
+};
+
+template<class Bus> constexpr typename dispatch_tables<Bus>::handler dispatch_tables<Bus>::base[256];
+template<class Bus> constexpr typename dispatch_tables<Bus>::handler dispatch_tables<Bus>::cb[256];
+#endif
+
+#ifdef CPU_FUSION
+#ifdef CPU_COMPUTED_GOTO
+#error "fused idioms call the table handlers, build them with DISPATCH=table"
+#endif
+
+template<class Bus>
+struct fusion_tables {
+    typedef int (basic_cpu<Bus>::*fused_handler)(const decoded_instr*);
+
+    static constexpr fused_handler handlers[FUSION_COUNT] = {
+        nullptr,
+        #define FUSION(name, ...) &basic_cpu<Bus>::template run_fused<__VA_ARGS__>,
+        #include "fusions.inc"
+    };
+};
+
+template<class Bus> constexpr typename fusion_tables<Bus>::fused_handler fusion_tables<Bus>::handlers[FUSION_COUNT];
+#endif
+
+#ifdef CPU_JIT
+#ifdef CPU_COMPUTED_GOTO
+#error "the jit calls the table handlers, build it with DISPATCH=table"
+#endif
+
+template<class Bus, int OP> static void op_thunk(basic_cpu<Bus>* gb) { (gb->*dispatch_tables<Bus>::base[OP])(); }
+
+template<class Bus, std::size_t... I>
+std::array<typename basic_cpu<Bus>::thunk, 256> make_thunk_table(std::index_sequence<I...>) {
+    return {{ &op_thunk<Bus, I>... }};
+}
 
-    mem.bootRomEnabled = true;
-    mem.ERAM_ENABLE = 0;
-    std::ifstream file;
-    file.open(rom, std::ios::in | std::ios::binary);
+template<class Bus>
+const std::array<typename basic_cpu<Bus>::thunk, 256> basic_cpu<Bus>::op_thunks = make_thunk_table<Bus>(std::make_index_sequence<256>());
+#endif
 
-    if (!file.is_open()) {
+template<class Bus>
+void basic_cpu<Bus>::initialize(std::string rom) {
+
+    std::shared_ptr<const rom_image> image = rom_image::open(rom);
+
+    if (!image) {
         std::cout << "Could not locate source file: " << rom <<  "\n";
         exit( 1 );
     } else {
         std::cout << "\n\nLoading rom file: " << rom << "\n";
     }
 
-    file.seekg(0, std::ios::end);
-    size_t fileSize = file.tellg();
-    file.seekg(0);
+    size_t fileSize = image->file_size();
 
-    if (fileSize < 0x4000 || fileSize > 0x800000) {
+    if (fileSize < 0x4000 || fileSize > MAX_ROM_SIZE) {
         std::cout << "Invalid ROM size: " << fileSize << " bytes\n";
         exit(1);
     }
 
-    char byte;
-    int address = 0;
+    mem.insert_cartridge(image); //the rom header decides the bank mapping
 
-    while (file.get(byte) && address < MAX_ROM_SIZE) {
+    code_cache.reset(); //new rom, drop anything decoded from the old one
+#ifdef CPU_JIT
+    code_jit.reset();
+#endif
 
-        mem.cart.romBank[address] = static_cast<uint8_t>(byte);
+    reset();
 
-        address++;
-    }
+    uint8_t mapper = mem.rd(0x147);
 
-    file.close();
+    std::cout << "MAPPER: " << std::hex << +mapper << "\n";
 
-    mem.ld(0x0, 0xFF40); //LCDC
-    mem.ld(0xFF, 0xFF00);
+}
 
-    mem.ld(0b10000000, 0xFF02); //SERIAL PORT DISABLED
+//power cycle with the same cartridge in: registers and every component back to
+//their power on state, without going through the bus. code decoded from the rom stays cached
+template<class Bus>
+void basic_cpu<Bus>::reset() {
 
-    uint8_t mapper = mem.rd(0x147);
+    mem.reset();
 
-    std::cout << "MAPPER: " << std::hex << +mapper << "\n";
+    AF = 0x01B0;
+    BC = DE = HL = 0x0000;
+    PC = 0x0;
+    SP = 0xFFFE;
 
+    IME = true;
+    ime_schedule = enable_pending = disable_pending = false;
+    stopped = halted = haltBug = false;
+
+    opcode = 0;
+    n16 = a8 = 0;
+    n8 = 0;
+    e8 = 0;
+    dataRet = 0;
+    cycles = 0;
+    pending = 0;
+    lazy_op = LAZY_NONE;
+
+    code_cache.restart();
+
+    if (fast_boot) { //registers as the boot rom hands them to the cartridge
+        mem.skip_boot_rom();
+        AF = mem.rd(0x14D) ? 0x01B0 : 0x0180; //H and C come from the header checksum
+        BC = 0x0013;
+        DE = 0x00D8;
+        HL = 0x014D;
+        PC = 0x0100;
+    }
 }
 
 
 
-int cpu::execute() {
+//interrupt and ime bookkeeping done before every instruction, returns false while halted
+template<class Bus>
+bool basic_cpu<Bus>::begin_instruction() {
 
-    uint8_t IE = mem.rd(0xFFFF);
-    uint8_t IF = mem.rd(0xFF0F);
-    uint8_t pending = IE & IF;
+    pending = mem.interrupt_pending();
 
     if (ime_schedule) {
         IME = true;
@@ -85,316 +165,142 @@ int cpu::execute() {
             halted = false;
         }
         cycles = 4;
-        return cycles;
+        return false;
     }
 
     if (haltBug) {
         haltBug = false;
     }
 
+    return true;
+}
+
+//operand latch for an instruction that comes predecoded from the block cache
+template<class Bus>
+void basic_cpu<Bus>::load_operands(const decoded_instr* decoded) {
 
-    //get current opcode
-    opcode = mem.rd(PC);
-
-    uint16_t n16 = (mem.rd(PC + 2) << 8) | mem.rd(PC + 1);
-    uint8_t  n8  =  mem.rd(PC + 1);
-    uint16_t a8 = 0xFF00 + n8;
-    int8_t  e8 = static_cast<int8_t>(n8);
-
-
-    switch(opcode) {
-
-        case 0x00: PC++; cycles = 4; break; //NOP
-        case 0x01: BC = n16; PC += 3; cycles = 12; break;
-        case 0x02: mem.ld(get_A(), BC); PC++; cycles = 8; break;
-        case 0x03: inc_BC(); PC++; cycles = 8; break;
-        case 0x04: set_B(INC(get_B())); PC++; cycles = 4; break; //INC B
-        case 0x05: set_B(DEC(get_B())); PC++; cycles = 4; break; //DEC B
-        case 0x06: set_B(n8); PC += 2; cycles = 8; break;
-        case 0x07: set_A(RLC(get_A())); set_ZF(false); PC++; cycles = 4; break;
-        case 0x08: mem.ld(SP & 0xFF, n16); mem.ld(SP >> 8, n16 + 1); PC += 3; cycles = 20; break;
-        case 0x09: HL = ADD16(HL , BC); PC++; cycles = 8; break;
-        case 0x0A: set_A(mem.rd(BC)); PC++; cycles = 8; break;
-        case 0x0B: dec_BC(); PC++; cycles = 8; break;
-        case 0x0C: set_C(INC(get_C())); PC++; cycles = 4; break;
-        case 0x0D: set_C(DEC(get_C())); PC++; cycles = 4; break;
-        case 0x0E: set_C(n8); PC += 2; cycles = 8; break;
-        case 0x0F: set_A(RRC(get_A())); set_ZF(false); PC++; cycles = 4; break;
-
-
-        case 0x10: stop(n8); cycles = 4; break;
-        case 0x11: DE = n16; PC += 3; cycles = 12; break;
-        case 0x12: mem.ld(get_A(), DE); PC++; cycles = 8; break;
-        case 0x13: inc_DE(); PC++; cycles = 8; break;
-        case 0x14: set_D(INC(get_D())); PC++; cycles = 4; break;
-        case 0x15: set_D(DEC(get_D())); PC++; cycles = 4; break;
-        case 0x16: set_D(n8); PC += 2; cycles = 8; break;
-        case 0x17: set_A(RL(get_A())); set_ZF(false); PC++; cycles = 4; break;
-        case 0x18: PC += 2 + e8; cycles = 12; break;
-        case 0x19: HL = ADD16(HL, DE); PC++; cycles = 8; break;
-        case 0x1A: set_A(mem.rd(DE)); PC++; cycles = 8; break;
-        case 0x1B: dec_DE(); PC++; cycles = 8; break;
-        case 0x1C: set_E(INC(get_E())); PC++; cycles = 4; break;
-        case 0x1D: set_E(DEC(get_E())); PC++; cycles = 4; break;
-        case 0x1E: set_E(n8); PC += 2; cycles = 8; break;
-        case 0x1F: set_A(RR(get_A())); set_ZF(false); PC++; cycles = 4; break;
-
-
-        case 0x20: if((get_ZF()) == 0){PC += 2 + e8; cycles = 12;} else { PC += 2; cycles = 8;}; break;
-        case 0x21: HL = n16; PC += 3; cycles = 12; break;
-        case 0x22: mem.ld(get_A(), HL); inc_HL(); PC++; cycles = 8; break;
-        case 0x23: inc_HL(); PC++; cycles = 8; break;
-        case 0x24: set_H(INC(get_H())); PC++; cycles = 4; break;
-        case 0x25: set_H(DEC(get_H())); PC++; cycles = 4; break;
-        case 0x26: set_H(n8); PC += 2; cycles = 8; break;
-        case 0x27: DAA(); PC++; cycles = 4; break;
-        case 0x28: if((get_ZF()) == 1){PC += 2 + e8; cycles = 12;} else { PC += 2; cycles = 8;}; break;
-        case 0x29: HL = ADD16(HL, HL); PC++; cycles = 8; break;
-        case 0x2A: set_A(mem.rd(HL)); inc_HL(); PC++; cycles = 8; break;
-        case 0x2B: dec_HL(); PC++; cycles = 8; break;
-        case 0x2C: set_L(INC(get_L())); PC++; cycles = 4; break;
-        case 0x2D: set_L(DEC(get_L())); PC++; cycles = 4; break;
-        case 0x2E: set_L(n8); PC += 2; cycles = 8; break;
-        case 0x2F: set_A(~get_A()); set_NF(true); set_HF(true);  PC++; cycles = 4; break; //CPL
-
-
-        case 0x30: if((get_CF() == 0)) {PC += 2 + e8; cycles = 12;} else { PC += 2; cycles = 8;}; break;
-        case 0x31: SP = n16; PC += 3; cycles = 12; break;
-        case 0x32: mem.ld(get_A(), HL); dec_HL(); PC++; cycles = 8; break;
-        case 0x33: inc_SP(); PC++; cycles = 8; break;
-        case 0x34: mem.ld(INC(mem.rd(HL)), HL); PC++; cycles = 12; break;
-        case 0x35: mem.ld(DEC(mem.rd(HL)), HL); PC++; cycles = 12; break;
-        case 0x36: mem.ld(n8, HL); PC += 2; cycles = 12; break;
-        case 0x37: set_NF(false); set_HF(false); set_CF(true); PC++; cycles = 4; break; //SCF 
-        case 0x38: if((get_CF() == 1)) {PC += 2 + e8; cycles = 12;} else { PC += 2; cycles = 8;}; break;
-        case 0x39: HL = ADD16(HL, SP); PC++; cycles = 8; break;
-        case 0x3A: set_A(mem.rd(HL)); dec_HL(); PC++; cycles = 8; break;
-        case 0x3B: dec_SP(); PC++; cycles = 8; break;
-        case 0x3C: set_A(INC(get_A())); PC++; cycles = 4; break;
-        case 0x3D: set_A(DEC(get_A())); PC++; cycles = 4; break;
-        case 0x3E: set_A(n8); PC += 2; cycles = 8; break;
-        case 0x3F: if(get_CF()){set_CF(false);} else {set_CF(true);}; set_NF(false); set_HF(false); PC++; cycles = 4; break; //CCF
-        
-
-        case 0x40: set_B(get_B()); PC++; cycles = 4; break;
-        case 0x41: set_B(get_C()); PC++; cycles = 4; break;
-        case 0x42: set_B(get_D()); PC++; cycles = 4; break;
-        case 0x43: set_B(get_E()); PC++; cycles = 4; break;
-        case 0x44: set_B(get_H()); PC++; cycles = 4; break;
-        case 0x45: set_B(get_L()); PC++; cycles = 4; break;
-        case 0x46: set_B(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x47: set_B(get_A()); PC++; cycles = 4; break;
-        case 0x48: set_C(get_B()); PC++; cycles = 4; break;
-        case 0x49: set_C(get_C()); PC++; cycles = 4; break;
-        case 0x4A: set_C(get_D()); PC++; cycles = 4; break;
-        case 0x4B: set_C(get_E()); PC++; cycles = 4; break;
-        case 0x4C: set_C(get_H()); PC++; cycles = 4; break;
-        case 0x4D: set_C(get_L()); PC++; cycles = 4; break;
-        case 0x4E: set_C(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x4F: set_C(get_A()); PC++; cycles = 4; break;
-
-
-        case 0x50: set_D(get_B()); PC++; cycles = 4; break;
-        case 0x51: set_D(get_C()); PC++; cycles = 4; break;
-        case 0x52: set_D(get_D()); PC++; cycles = 4; break;
-        case 0x53: set_D(get_E()); PC++; cycles = 4; break;
-        case 0x54: set_D(get_H()); PC++; cycles = 4; break;
-        case 0x55: set_D(get_L()); PC++; cycles = 4; break;
-        case 0x56: set_D(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x57: set_D(get_A()); PC++; cycles = 4; break;
-        case 0x58: set_E(get_B()); PC++; cycles = 4; break;
-        case 0x59: set_E(get_C()); PC++; cycles = 4; break;
-        case 0x5A: set_E(get_D()); PC++; cycles = 4; break;
-        case 0x5B: set_E(get_E()); PC++; cycles = 4; break;
-        case 0x5C: set_E(get_H()); PC++; cycles = 4; break;
-        case 0x5D: set_E(get_L()); PC++; cycles = 4; break;
-        case 0x5E: set_E(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x5F: set_E(get_A()); PC++; cycles = 4; break;
-
-
-        case 0x60: set_H(get_B()); PC++; cycles = 4; break;
-        case 0x61: set_H(get_C()); PC++; cycles = 4; break;
-        case 0x62: set_H(get_D()); PC++; cycles = 4; break;
-        case 0x63: set_H(get_E()); PC++; cycles = 4; break;
-        case 0x64: set_H(get_H()); PC++; cycles = 4; break;
-        case 0x65: set_H(get_L()); PC++; cycles = 4; break;
-        case 0x66: set_H(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x67: set_H(get_A()); PC++; cycles = 4; break;
-        case 0x68: set_L(get_B()); PC++; cycles = 4; break;
-        case 0x69: set_L(get_C()); PC++; cycles = 4; break;
-        case 0x6A: set_L(get_D()); PC++; cycles = 4; break;
-        case 0x6B: set_L(get_E()); PC++; cycles = 4; break;
-        case 0x6C: set_L(get_H()); PC++; cycles = 4; break;
-        case 0x6D: set_L(get_L()); PC++; cycles = 4; break;
-        case 0x6E: set_L(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x6F: set_L(get_A()); PC++; cycles = 4; break;
-
-
-        case 0x70: mem.ld(get_B(), HL); PC++; cycles = 8; break;
-        case 0x71: mem.ld(get_C(), HL); PC++; cycles = 8; break;
-        case 0x72: mem.ld(get_D(), HL); PC++; cycles = 8; break;
-        case 0x73: mem.ld(get_E(), HL); PC++; cycles = 8; break;
-        case 0x74: mem.ld(get_H(), HL); PC++; cycles = 8; break;
-        case 0x75: mem.ld(get_L(), HL); PC++; cycles = 8; break;
-        case 0x76: halt(); PC++; cycles = 4; break;
-        case 0x77: mem.ld(get_A(), HL); PC++; cycles = 8; break;
-        case 0x78: set_A(get_B()); PC++; cycles = 4; break;
-        case 0x79: set_A(get_C()); PC++; cycles = 4; break;
-        case 0x7A: set_A(get_D()); PC++; cycles = 4; break;
-        case 0x7B: set_A(get_E()); PC++; cycles = 4; break;
-        case 0x7C: set_A(get_H()); PC++; cycles = 4; break;
-        case 0x7D: set_A(get_L()); PC++; cycles = 4; break;
-        case 0x7E: set_A(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x7F: set_A(get_A()); PC++; cycles = 4; break;
-
-
-        case 0x80: ADD8(get_B()); PC++; cycles = 4; break;
-        case 0x81: ADD8(get_C()); PC++; cycles = 4; break;
-        case 0x82: ADD8(get_D()); PC++; cycles = 4; break;
-        case 0x83: ADD8(get_E()); PC++; cycles = 4; break;
-        case 0x84: ADD8(get_H()); PC++; cycles = 4; break;
-        case 0x85: ADD8(get_L()); PC++; cycles = 4; break;
-        case 0x86: ADD8(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x87: ADD8(get_A()); PC++; cycles = 4; break;
-        case 0x88: ADC(get_B()); PC++; cycles = 4; break;
-        case 0x89: ADC(get_C()); PC++; cycles = 4; break;
-        case 0x8A: ADC(get_D()); PC++; cycles = 4; break;
-        case 0x8B: ADC(get_E()); PC++; cycles = 4; break;
-        case 0x8C: ADC(get_H()); PC++; cycles = 4; break;
-        case 0x8D: ADC(get_L()); PC++; cycles = 4; break;
-        case 0x8E: ADC(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x8F: ADC(get_A()); PC++; cycles = 4; break;
-
-
-        case 0x90: SUB(get_B()); PC++; cycles = 4; break;
-        case 0x91: SUB(get_C()); PC++; cycles = 4; break;
-        case 0x92: SUB(get_D()); PC++; cycles = 4; break;
-        case 0x93: SUB(get_E()); PC++; cycles = 4; break;
-        case 0x94: SUB(get_H()); PC++; cycles = 4; break;
-        case 0x95: SUB(get_L()); PC++; cycles = 4; break;
-        case 0x96: SUB(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x97: set_A(0); set_ZF(true); set_NF(true); set_HF(false); set_CF(false); PC++; cycles = 4; break;
-        case 0x98: SBC(get_B()); PC++; cycles = 4; break;
-        case 0x99: SBC(get_C()); PC++; cycles = 4; break;
-        case 0x9A: SBC(get_D()); PC++; cycles = 4; break;
-        case 0x9B: SBC(get_E()); PC++; cycles = 4; break;
-        case 0x9C: SBC(get_H()); PC++; cycles = 4; break;
-        case 0x9D: SBC(get_L()); PC++; cycles = 4; break;
-        case 0x9E: SBC(mem.rd(HL)); PC++; cycles = 8; break;
-        case 0x9F: SBC(get_A()); PC++; cycles = 4; break;
-
-
-        case 0xA0: set_A(AND(get_A(), get_B())); PC++; cycles = 4; break;
-        case 0xA1: set_A(AND(get_A(), get_C())); PC++; cycles = 4; break;
-        case 0xA2: set_A(AND(get_A(), get_D())); PC++; cycles = 4; break;
-        case 0xA3: set_A(AND(get_A(), get_E())); PC++; cycles = 4; break;
-        case 0xA4: set_A(AND(get_A(), get_H())); PC++; cycles = 4; break;
-        case 0xA5: set_A(AND(get_A(), get_L())); PC++; cycles = 4; break;
-        case 0xA6: set_A(AND(get_A(), mem.rd(HL))); PC++; cycles = 8; break;
-        case 0xA7: set_A(AND(get_A(), get_A())); PC++; cycles = 4; break;
-        case 0xA8: set_A(XOR(get_A(), get_B())); PC++; cycles = 4; break;
-        case 0xA9: set_A(XOR(get_A(), get_C())); PC++; cycles = 4; break;
-        case 0xAA: set_A(XOR(get_A(), get_D())); PC++; cycles = 4; break;
-        case 0xAB: set_A(XOR(get_A(), get_E())); PC++; cycles = 4; break;
-        case 0xAC: set_A(XOR(get_A(), get_H())); PC++; cycles = 4; break;
-        case 0xAD: set_A(XOR(get_A(), get_L())); PC++; cycles = 4; break;
-        case 0xAE: set_A(XOR(get_A(), mem.rd(HL))); PC++; cycles = 8; break;
-        case 0xAF: set_A(0); set_ZF(true); set_NF(false); set_HF(false); set_CF(false); PC++; cycles = 4; break;
-
-
-        case 0xB0: set_A(OR(get_A(), get_B())); PC++; cycles = 4; break;
-        case 0xB1: set_A(OR(get_A(), get_C())); PC++; cycles = 4; break;
-        case 0xB2: set_A(OR(get_A(), get_D())); PC++; cycles = 4; break;
-        case 0xB3: set_A(OR(get_A(), get_E())); PC++; cycles = 4; break;
-        case 0xB4: set_A(OR(get_A(), get_H())); PC++; cycles = 4; break;
-        case 0xB5: set_A(OR(get_A(), get_L())); PC++; cycles = 4; break;
-        case 0xB6: set_A(OR(get_A(), mem.rd(HL))); PC++; cycles = 8; break;
-        case 0xB7: set_A(OR(get_A(), get_A())); PC++; cycles = 4; break;
-        case 0xB8: CP(get_A(), get_B()); PC++; cycles = 4; break;
-        case 0xB9: CP(get_A(), get_C()); PC++; cycles = 4; break;
-        case 0xBA: CP(get_A(), get_D()); PC++; cycles = 4; break;
-        case 0xBB: CP(get_A(), get_E()); PC++; cycles = 4; break;
-        case 0xBC: CP(get_A(), get_H()); PC++; cycles = 4; break;
-        case 0xBD: CP(get_A(), get_L()); PC++; cycles = 4; break;
-        case 0xBE: CP(get_A(), mem.rd(HL)); PC++; cycles = 8; break;
-        case 0xBF: set_ZF(true); set_NF(true); set_HF(false); set_CF(false); PC++; cycles = 4; break;
-
-
-        case 0xC0: if(get_ZF() == 0) {POP(PC); cycles = 20;} else {PC++; cycles = 8;}; break;
-        case 0xC1: POP(BC); PC++; cycles = 12; break;
-        case 0xC2: if(get_ZF() == 0) {PC = n16; cycles = 16;} else {PC += 3; cycles = 12;}; break;
-        case 0xC3: PC = n16; cycles = 16; break;
-        case 0xC4: if(get_ZF() == 0) {PUSH(PC + 3); PC = n16; cycles = 24;} else {PC += 3; cycles = 12;}; break;
-        case 0xC5: PUSH(BC); PC++; cycles = 16; break;
-        case 0xC6: ADD8(n8); PC += 2; cycles = 8; break;
-        case 0xC7: PUSH(PC + 1); PC = 0x00; cycles = 16; break; // RST $00
-        case 0xC8: if(get_ZF() == 1) {POP(PC); cycles = 20;} else {PC++; cycles = 8;}; break;
-        case 0xC9: POP(PC); cycles = 16; break; //return from subroutine
-        case 0xCA: if(get_ZF() == 1) {PC = n16; cycles = 16;} else {PC += 3; cycles = 12;}; break;
-        case 0xCB: PREFIXED(); PC += 2; break;
-        case 0xCC: if(get_ZF() == 1) {PUSH(PC + 3); PC = n16; cycles = 24;} else {PC += 3; cycles = 12;}; break;
-        case 0xCD: PUSH(PC + 3); PC = n16; cycles = 24; break;  
-        case 0xCE: ADC(n8); PC += 2; cycles = 8; break;
-        case 0xCF: PUSH(PC + 1); PC = 0x08; cycles = 16; break; // RST $08
-
-
-        case 0xD0: if(get_CF() == 0) {POP(PC); cycles = 20;} else {PC++; cycles = 8;}; break;
-        case 0xD1: POP(DE); PC++; cycles = 12; break;
-        case 0xD2: if(get_CF() == 0) {PC = n16; cycles = 16;} else {PC += 3; cycles = 12;}; break;
-        //ILLEGAL OPCODE 0xD3
-        case 0xD4: if(get_CF() == 0) {PUSH(PC + 3); PC = n16; cycles = 24;} else {PC += 3; cycles = 12;}; break;
-        case 0xD5: PUSH(DE); PC++; cycles = 16; break;
-        case 0xD6: SUB(n8); PC += 2; cycles = 8; break;
-        case 0xD7: PUSH(PC + 1); PC = 0x10; cycles = 16; break; // RST $10
-        case 0xD8: if(get_CF() == 1) {POP(PC); cycles = 20;} else {PC++; cycles = 8;}; break;
-        case 0xD9: POP(PC); cycles = 16; IME = true; break;
-        case 0xDA: if(get_CF() == 1) {PC = n16; cycles = 16;} else {PC += 3; cycles = 12;}; break;
-        //ILLEGAL OPCODE 0xDB
-        case 0xDC: if(get_CF() == 1) {PUSH(PC + 3); PC = n16; cycles = 24;} else {PC += 3; cycles = 12;}; break;
-        //ILLEGAL OPCODE 0xDD
-        case 0xDE: SBC(n8); PC += 2; cycles = 8; break;
-        case 0xDF: PUSH(PC + 1); PC = 0x18; cycles = 16; break; // RST $18
-
-
-        case 0xE0: mem.ld(get_A(), a8); PC += 2; cycles = 12; break;
-        case 0xE1: POP(HL); PC++; cycles = 12; break;
-        case 0xE2: mem.ld(get_A(), 0xFF00 + get_C()); PC++; cycles = 8; break;
-        //ILLEGAL OPCODE 0xE3
-        //ILLEGAL OPCODE 0xE4
-        case 0xE5: PUSH(HL); PC++; cycles = 16; break;
-        case 0xE6: set_A(AND(get_A(), n8)); PC += 2; cycles = 8; break;
-        case 0xE7: PUSH(PC + 1); PC = 0x20; cycles = 16; break; // RST $20
-        case 0xE8: SP = SPADD(n8); PC += 2; cycles = 12; break;
-        case 0xE9: PC = HL; cycles = 4; break;
-        case 0xEA: mem.ld(get_A(), n16); PC += 3; cycles = 16; break;
-        //ILLEGAL OPCODE 0xEB
-        //ILLEGAL OPCODE 0xEC
-        //ILLEGAL OPCODE 0xED
-        case 0xEE: set_A(XOR(get_A(), n8)); PC += 2; cycles = 8; break;
-        case 0xEF: PUSH(PC + 1); PC = 0x28; cycles = 16; break; // RST $28
-
-
-        case 0xF0: set_A(mem.rd(a8)); PC += 2; cycles = 12; break;
-        case 0xF1: POP_AF(); PC++; cycles = 16; break;
-        case 0xF2: set_A(mem.rd(0xFF00 + get_C())); PC++; cycles = 8; break;
-        case 0xF3: disable_pending = true; ime_schedule = false; PC++; cycles = 4; break;
-        //ILLEGAL OPCODE 0xF4
-        case 0xF5: PUSH_AF(); PC++; cycles = 16; break;
-        case 0xF6: set_A(OR(get_A(), n8)); PC += 2; cycles = 8; break;
-        case 0xF7: PUSH(PC + 1); PC = 0x30; cycles = 16; break; // RST $30
-        case 0xF8: HL = SPADD(n8); PC += 2; cycles = 12; break;
-        case 0xF9: SP = HL; PC++; cycles = 8; break;
-        case 0xFA: set_A(mem.rd(n16)); PC += 3; cycles = 16; break;
-        case 0xFB: enable_pending = true; PC++; cycles = 4; break;
-        //ILLEGAL OPCODE 0xFC
-        //ILLEGAL OPCODE 0xFD
-        case 0xFE: CP(get_A(), n8); PC += 2; cycles = 8; break;
-        case 0xFF: PUSH(PC + 1); PC = 0x38; cycles = 16; break;  // RST $38
-
-        default:
-            std::cout << "UNKNOWN OPCODE: " << std::hex << +opcode << "\n";
-            PC++;
+    opcode = decoded->opcode;
+
+    if (decoded->length == 2) {
+        n16 = decoded->operand;
+    } else if (decoded->length == 1) {
+        n8 = decoded->operand;
+        a8 = 0xFF00 + n8;
+        e8 = static_cast<int8_t>(n8);
+    }
+}
+
+#ifdef CPU_FUSION
+//runs an idiom from fusions.inc. between its instructions it does exactly what the
+//main loop does between two execute() calls, and it hands back to the main loop as
+//soon as control flow leaves the idiom, the cpu halts or the frame runs out.
+//returns every cycle it ran, the last instruction's are left in cycles for the caller to tick
+template<class Bus>
+template<int... OPS>
+int basic_cpu<Bus>::run_fused(const decoded_instr* instr) {
+
+    static constexpr handler handlers[] = { dispatch_tables<Bus>::base[OPS]... };
+    const int count = sizeof...(OPS);
+
+    fusion_counts[instr->fusion]++;
+
+    int total = 0;
+    uint16_t next_pc = PC + 1 + instr->length;
+
+    for (int i = 0; ; i++) {
+
+        (this->*handlers[i])();
+        handle_interrupts(pending);
+
+        if (i == count - 1 || PC != next_pc || halted || total + cycles >= cycle_budget) {
+            code_cache.skip(i, next_pc);
+            return total + cycles;
+        }
+
+        peripheral_tick(cycles);
+        total += cycles;
+
+        begin_instruction();
+        load_operands(++instr);
+        next_pc = PC + 1 + instr->length;
+
+        if (Bus::instrumented) {
+            instructions_executed++;
+            operand_reads_saved += 3;
+        }
     }
+}
+#endif
+
+template<class Bus>
+int basic_cpu<Bus>::execute() {
+
+    if (!begin_instruction()) {
+        return cycles;
+    }
+
+    //rom code comes predecoded from the block cache, everything else is decoded here
+    const decoded_instr* decoded = code_cache.fetch(PC);
+
+    if (decoded) {
+
+        load_operands(decoded);
+
+        if (Bus::instrumented) {
+            operand_reads_saved += 3;
+        }
+
+    } else {
+
+        //get current opcode
+        opcode = mem.rd(PC);
+
+        //fetch only the operand bytes this opcode actually uses
+        uint8_t length = operand_bytes[opcode];
+
+        if (length == 2) {
+            n16 = (mem.rd(PC + 2) << 8) | mem.rd(PC + 1);
+        } else if (length == 1) {
+            n8 = mem.rd(PC + 1);
+            a8 = 0xFF00 + n8;
+            e8 = static_cast<int8_t>(n8);
+        }
+
+        if (Bus::instrumented) {
+            operand_reads_saved += 3 - length; //the old decoder always did 3 operand reads
+        }
+    }
+
+    if (Bus::instrumented) {
+        instructions_executed++;
+    }
+
+#ifdef CPU_FUSION
+    if (decoded && decoded->fusion) {
+        return (this->*fusion_tables<Bus>::handlers[decoded->fusion])(decoded);
+    }
+#endif
+
+#ifdef CPU_COMPUTED_GOTO
+
+    static const void* const base_labels[256] = {
+        #define OP(code, ...) &&op_##code,
+        #define ILLEGAL(code) &&op_##code,
+        #include "opcodes.inc"
+    };
+
+    goto *base_labels[opcode];
+
+    #define OP(code, ...) op_##code: { __VA_ARGS__ } goto dispatched;
+    #define ILLEGAL(code) op_##code: { unknown_opcode(); } goto dispatched;
+    #include "opcodes.inc"
+
+dispatched:
+
+#else
+
+    (this->*dispatch_tables<Bus>::base[opcode])();
+#endif
 
 
     handle_interrupts(pending);
@@ -402,336 +308,87 @@ int cpu::execute() {
     return cycles;
 }
 
-void cpu::PREFIXED() {
-    switch (mem.rd(PC + 1)) {
-
-        case 0x00: set_B(RLC(get_B())); cycles = 12; break;
-        case 0x01: set_C(RLC(get_C())); cycles = 12; break;
-        case 0x02: set_D(RLC(get_D())); cycles = 12; break;
-        case 0x03: set_E(RLC(get_E())); cycles = 12; break;
-        case 0x04: set_H(RLC(get_H())); cycles = 12; break;
-        case 0x05: set_L(RLC(get_L())); cycles = 12; break;
-        case 0x06: mem.ld(RLC(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x07: set_A(RLC(get_A())); cycles = 12; break;
-        case 0x08: set_B(RRC(get_B())); cycles = 12; break;
-        case 0x09: set_C(RRC(get_C())); cycles = 12; break;
-        case 0x0A: set_D(RRC(get_D())); cycles = 12; break;
-        case 0x0B: set_E(RRC(get_E())); cycles = 12; break;
-        case 0x0C: set_H(RRC(get_H())); cycles = 12; break;
-        case 0x0D: set_L(RRC(get_L())); cycles = 12; break;
-        case 0x0E: mem.ld(RRC(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x0F: set_A(RRC(get_A())); cycles = 12; break;
-
-
-        case 0x10: set_B(RL(get_B())); cycles = 12; break;
-        case 0x11: set_C(RL(get_C())); cycles = 12; break;
-        case 0x12: set_D(RL(get_D())); cycles = 12; break;
-        case 0x13: set_E(RL(get_E())); cycles = 12; break;
-        case 0x14: set_H(RL(get_H())); cycles = 12; break;
-        case 0x15: set_L(RL(get_L())); cycles = 12; break;
-        case 0x16: mem.ld(RL(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x17: set_A(RL(get_A())); cycles = 12; break;
-        case 0x18: set_B(RR(get_B())); cycles = 12; break;
-        case 0x19: set_C(RR(get_C())); cycles = 12; break;
-        case 0x1A: set_D(RR(get_D())); cycles = 12; break;
-        case 0x1B: set_E(RR(get_E())); cycles = 12; break;
-        case 0x1C: set_H(RR(get_H())); cycles = 12; break;
-        case 0x1D: set_L(RR(get_L())); cycles = 12; break;
-        case 0x1E: mem.ld(RR(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x1F: set_A(RR(get_A())); cycles = 12; break;
-
-
-        case 0x20: set_B(SLA(get_B())); cycles = 12; break;
-        case 0x21: set_C(SLA(get_C())); cycles = 12; break;
-        case 0x22: set_D(SLA(get_D())); cycles = 12; break;
-        case 0x23: set_E(SLA(get_E())); cycles = 12; break;
-        case 0x24: set_H(SLA(get_H())); cycles = 12; break;
-        case 0x25: set_L(SLA(get_L())); cycles = 12; break;
-        case 0x26: mem.ld(SLA(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x27: set_A(SLA(get_A())); cycles = 12; break;
-        case 0x28: set_B(SRA(get_B())); cycles = 12; break;
-        case 0x29: set_C(SRA(get_C())); cycles = 12; break;
-        case 0x2A: set_D(SRA(get_D())); cycles = 12; break;
-        case 0x2B: set_E(SRA(get_E())); cycles = 12; break;
-        case 0x2C: set_H(SRA(get_H())); cycles = 12; break;
-        case 0x2D: set_L(SRA(get_L())); cycles = 12; break;
-        case 0x2E: mem.ld(SRA(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x2F: set_A(SRA(get_A())); cycles = 12; break;
-
-
-        case 0x30: set_B(SWAP(get_B())); cycles = 12; break;
-        case 0x31: set_C(SWAP(get_C())); cycles = 12; break;
-        case 0x32: set_D(SWAP(get_D())); cycles = 12; break;
-        case 0x33: set_E(SWAP(get_E())); cycles = 12; break;
-        case 0x34: set_H(SWAP(get_H())); cycles = 12; break;
-        case 0x35: set_L(SWAP(get_L())); cycles = 12; break;
-        case 0x36: mem.ld(SWAP(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x37: set_A(SWAP(get_A())); cycles = 12; break;
-        case 0x38: set_B(SRL(get_B())); cycles = 12; break;
-        case 0x39: set_C(SRL(get_C())); cycles = 12; break;
-        case 0x3A: set_D(SRL(get_D())); cycles = 12; break;
-        case 0x3B: set_E(SRL(get_E())); cycles = 12; break;
-        case 0x3C: set_H(SRL(get_H())); cycles = 12; break;
-        case 0x3D: set_L(SRL(get_L())); cycles = 12; break;
-        case 0x3E: mem.ld(SRL(mem.rd(HL)), HL); cycles = 20; break;
-        case 0x3F: set_A(SRL(get_A())); cycles = 12; break;
-
-
-        case 0x40: BIT(0, get_B()); cycles = 12; break;
-        case 0x41: BIT(0, get_C()); cycles = 12; break;
-        case 0x42: BIT(0, get_D()); cycles = 12; break;
-        case 0x43: BIT(0, get_E()); cycles = 12; break;
-        case 0x44: BIT(0, get_H()); cycles = 12; break;
-        case 0x45: BIT(0, get_L()); cycles = 12; break;
-        case 0x46: BIT(0, mem.rd(HL)); cycles = 16; break;
-        case 0x47: BIT(0, get_A()); cycles = 12; break;
-        case 0x48: BIT(1, get_B()); cycles = 12; break;
-        case 0x49: BIT(1, get_C()); cycles = 12; break;
-        case 0x4A: BIT(1, get_D()); cycles = 12; break;
-        case 0x4B: BIT(1, get_E()); cycles = 12; break;
-        case 0x4C: BIT(1, get_H()); cycles = 12; break;
-        case 0x4D: BIT(1, get_L()); cycles = 12; break;
-        case 0x4E: BIT(1, mem.rd(HL)); cycles = 16; break;
-        case 0x4F: BIT(1, get_A()); cycles = 12; break;
-
-
-        case 0x50: BIT(2, get_B()); cycles = 12; break;
-        case 0x51: BIT(2, get_C()); cycles = 12; break;
-        case 0x52: BIT(2, get_D()); cycles = 12; break;
-        case 0x53: BIT(2, get_E()); cycles = 12; break;
-        case 0x54: BIT(2, get_H()); cycles = 12; break;
-        case 0x55: BIT(2, get_L()); cycles = 12; break;
-        case 0x56: BIT(2, mem.rd(HL)); cycles = 16; break;
-        case 0x57: BIT(2, get_A()); cycles = 12; break;
-        case 0x58: BIT(3, get_B()); cycles = 12; break;
-        case 0x59: BIT(3, get_C()); cycles = 12; break;
-        case 0x5A: BIT(3, get_D()); cycles = 12; break;
-        case 0x5B: BIT(3, get_E()); cycles = 12; break;
-        case 0x5C: BIT(3, get_H()); cycles = 12; break;
-        case 0x5D: BIT(3, get_L()); cycles = 12; break;
-        case 0x5E: BIT(3, mem.rd(HL)); cycles = 16; break;
-        case 0x5F: BIT(3, get_A()); cycles = 12; break;
-
-
-        case 0x60: BIT(4, get_B()); cycles = 12; break;
-        case 0x61: BIT(4, get_C()); cycles = 12; break;
-        case 0x62: BIT(4, get_D()); cycles = 12; break;
-        case 0x63: BIT(4, get_E()); cycles = 12; break;
-        case 0x64: BIT(4, get_H()); cycles = 12; break;
-        case 0x65: BIT(4, get_L()); cycles = 12; break;
-        case 0x66: BIT(4, mem.rd(HL)); cycles = 16; break;
-        case 0x67: BIT(4, get_A()); cycles = 12; break;
-        case 0x68: BIT(5, get_B()); cycles = 12; break;
-        case 0x69: BIT(5, get_C()); cycles = 12; break;
-        case 0x6A: BIT(5, get_D()); cycles = 12; break;
-        case 0x6B: BIT(5, get_E()); cycles = 12; break;
-        case 0x6C: BIT(5, get_H()); cycles = 12; break;
-        case 0x6D: BIT(5, get_L()); cycles = 12; break;
-        case 0x6E: BIT(5, mem.rd(HL)); cycles = 16; break;
-        case 0x6F: BIT(5, get_A()); cycles = 12; break;
-
-
-        case 0x70: BIT(6, get_B()); cycles = 12; break;
-        case 0x71: BIT(6, get_C()); cycles = 12; break;
-        case 0x72: BIT(6, get_D()); cycles = 12; break;
-        case 0x73: BIT(6, get_E()); cycles = 12; break;
-        case 0x74: BIT(6, get_H()); cycles = 12; break;
-        case 0x75: BIT(6, get_L()); cycles = 12; break;
-        case 0x76: BIT(6, mem.rd(HL)); cycles = 16; break;
-        case 0x77: BIT(6, get_A()); cycles = 12; break;
-        case 0x78: BIT(7, get_B()); cycles = 12; break;
-        case 0x79: BIT(7, get_C()); cycles = 12; break;
-        case 0x7A: BIT(7, get_D()); cycles = 12; break;
-        case 0x7B: BIT(7, get_E()); cycles = 12; break;
-        case 0x7C: BIT(7, get_H()); cycles = 12; break;
-        case 0x7D: BIT(7, get_L()); cycles = 12; break;
-        case 0x7E: BIT(7, mem.rd(HL)); cycles = 16; break;
-        case 0x7F: BIT(7, get_A()); cycles = 12; break;
-
-
-        case 0x80: set_B(RES(0, get_B())); cycles = 12; break;
-        case 0x81: set_C(RES(0, get_C())); cycles = 12; break;
-        case 0x82: set_D(RES(0, get_D())); cycles = 12; break;
-        case 0x83: set_E(RES(0, get_E())); cycles = 12; break;
-        case 0x84: set_H(RES(0, get_H())); cycles = 12; break;
-        case 0x85: set_L(RES(0, get_L())); cycles = 12; break;
-        case 0x86: mem.ld(RES(0, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0x87: set_A(RES(0, get_A())); cycles = 12; break;
-        case 0x88: set_B(RES(1, get_B())); cycles = 12; break;
-        case 0x89: set_C(RES(1, get_C())); cycles = 12; break;
-        case 0x8A: set_D(RES(1, get_D())); cycles = 12; break;
-        case 0x8B: set_E(RES(1, get_E())); cycles = 12; break;
-        case 0x8C: set_H(RES(1, get_H())); cycles = 12; break;
-        case 0x8D: set_L(RES(1, get_L())); cycles = 12; break;
-        case 0x8E: mem.ld(RES(1, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0x8F: set_A(RES(1, get_A())); cycles = 12; break;
-
-
-        case 0x90: set_B(RES(2, get_B())); cycles = 12; break;
-        case 0x91: set_C(RES(2, get_C())); cycles = 12; break;
-        case 0x92: set_D(RES(2, get_D())); cycles = 12; break;
-        case 0x93: set_E(RES(2, get_E())); cycles = 12; break;
-        case 0x94: set_H(RES(2, get_H())); cycles = 12; break;
-        case 0x95: set_L(RES(2, get_L())); cycles = 12; break;
-        case 0x96: mem.ld(RES(2, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0x97: set_A(RES(2, get_A())); cycles = 12; break;
-        case 0x98: set_B(RES(3, get_B())); cycles = 12; break;
-        case 0x99: set_C(RES(3, get_C())); cycles = 12; break;
-        case 0x9A: set_D(RES(3, get_D())); cycles = 12; break;
-        case 0x9B: set_E(RES(3, get_E())); cycles = 12; break;
-        case 0x9C: set_H(RES(3, get_H())); cycles = 12; break;
-        case 0x9D: set_L(RES(3, get_L())); cycles = 12; break;
-        case 0x9E: mem.ld(RES(3, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0x9F: set_A(RES(3, get_A())); cycles = 12; break;
-
-
-        case 0xA0: set_B(RES(4, get_B())); cycles = 12; break;
-        case 0xA1: set_C(RES(4, get_C())); cycles = 12; break;
-        case 0xA2: set_D(RES(4, get_D())); cycles = 12; break;
-        case 0xA3: set_E(RES(4, get_E())); cycles = 12; break;
-        case 0xA4: set_H(RES(4, get_H())); cycles = 12; break;
-        case 0xA5: set_L(RES(4, get_L())); cycles = 12; break;
-        case 0xA6: mem.ld(RES(4, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xA7: set_A(RES(4, get_A())); cycles = 12; break;
-        case 0xA8: set_B(RES(5, get_B())); cycles = 12; break;
-        case 0xA9: set_C(RES(5, get_C())); cycles = 12; break;
-        case 0xAA: set_D(RES(5, get_D())); cycles = 12; break;
-        case 0xAB: set_E(RES(5, get_E())); cycles = 12; break;
-        case 0xAC: set_H(RES(5, get_H())); cycles = 12; break;
-        case 0xAD: set_L(RES(5, get_L())); cycles = 12; break;
-        case 0xAE: mem.ld(RES(5, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xAF: set_A(RES(5, get_A())); cycles = 12; break;
-
-
-        case 0xB0: set_B(RES(6, get_B())); cycles = 12; break;
-        case 0xB1: set_C(RES(6, get_C())); cycles = 12; break;
-        case 0xB2: set_D(RES(6, get_D())); cycles = 12; break;
-        case 0xB3: set_E(RES(6, get_E())); cycles = 12; break;
-        case 0xB4: set_H(RES(6, get_H())); cycles = 12; break;
-        case 0xB5: set_L(RES(6, get_L())); cycles = 12; break;
-        case 0xB6: mem.ld(RES(6, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xB7: set_A(RES(6, get_A())); cycles = 12; break;
-        case 0xB8: set_B(RES(7, get_B())); cycles = 12; break;
-        case 0xB9: set_C(RES(7, get_C())); cycles = 12; break;
-        case 0xBA: set_D(RES(7, get_D())); cycles = 12; break;
-        case 0xBB: set_E(RES(7, get_E())); cycles = 12; break;
-        case 0xBC: set_H(RES(7, get_H())); cycles = 12; break;
-        case 0xBD: set_L(RES(7, get_L())); cycles = 12; break;
-        case 0xBE: mem.ld(RES(7, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xBF: set_A(RES(7, get_A())); cycles = 12; break;
-
-
-        case 0xC0: set_B(SET(0, get_B())); cycles = 12; break;
-        case 0xC1: set_C(SET(0, get_C())); cycles = 12; break;
-        case 0xC2: set_D(SET(0, get_D())); cycles = 12; break;
-        case 0xC3: set_E(SET(0, get_E())); cycles = 12; break;
-        case 0xC4: set_H(SET(0, get_H())); cycles = 12; break;
-        case 0xC5: set_L(SET(0, get_L())); cycles = 12; break;
-        case 0xC6: mem.ld(SET(0, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xC7: set_A(SET(0, get_A())); cycles = 12; break;
-        case 0xC8: set_B(SET(1, get_B())); cycles = 12; break;
-        case 0xC9: set_C(SET(1, get_C())); cycles = 12; break;
-        case 0xCA: set_D(SET(1, get_D())); cycles = 12; break;
-        case 0xCB: set_E(SET(1, get_E())); cycles = 12; break;
-        case 0xCC: set_H(SET(1, get_H())); cycles = 12; break;
-        case 0xCD: set_L(SET(1, get_L())); cycles = 12; break;
-        case 0xCE: mem.ld(SET(1, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xCF: set_A(SET(1, get_A())); cycles = 12; break;
-
-
-        case 0xD0: set_B(SET(2, get_B())); cycles = 12; break;
-        case 0xD1: set_C(SET(2, get_C())); cycles = 12; break;
-        case 0xD2: set_D(SET(2, get_D())); cycles = 12; break;
-        case 0xD3: set_E(SET(2, get_E())); cycles = 12; break;
-        case 0xD4: set_H(SET(2, get_H())); cycles = 12; break;
-        case 0xD5: set_L(SET(2, get_L())); cycles = 12; break;
-        case 0xD6: mem.ld(SET(2, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xD7: set_A(SET(2, get_A())); cycles = 12; break;
-        case 0xD8: set_B(SET(3, get_B())); cycles = 12; break;
-        case 0xD9: set_C(SET(3, get_C())); cycles = 12; break;
-        case 0xDA: set_D(SET(3, get_D())); cycles = 12; break;
-        case 0xDB: set_E(SET(3, get_E())); cycles = 12; break;
-        case 0xDC: set_H(SET(3, get_H())); cycles = 12; break;
-        case 0xDD: set_L(SET(3, get_L())); cycles = 12; break;
-        case 0xDE: mem.ld(SET(3, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xDF: set_A(SET(3, get_A())); cycles = 12; break;
-
-
-        case 0xE0: set_B(SET(4, get_B())); cycles = 12; break;
-        case 0xE1: set_C(SET(4, get_C())); cycles = 12; break;
-        case 0xE2: set_D(SET(4, get_D())); cycles = 12; break;
-        case 0xE3: set_E(SET(4, get_E())); cycles = 12; break;
-        case 0xE4: set_H(SET(4, get_H())); cycles = 12; break;
-        case 0xE5: set_L(SET(4, get_L())); cycles = 12; break;
-        case 0xE6: mem.ld(SET(4, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xE7: set_A(SET(4, get_A())); cycles = 12; break;
-        case 0xE8: set_B(SET(5, get_B())); cycles = 12; break;
-        case 0xE9: set_C(SET(5, get_C())); cycles = 12; break;
-        case 0xEA: set_D(SET(5, get_D())); cycles = 12; break;
-        case 0xEB: set_E(SET(5, get_E())); cycles = 12; break;
-        case 0xEC: set_H(SET(5, get_H())); cycles = 12; break;
-        case 0xED: set_L(SET(5, get_L())); cycles = 12; break;
-        case 0xEE: mem.ld(SET(5, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xEF: set_A(SET(5, get_A())); cycles = 12; break;
-
-
-        case 0xF0: set_B(SET(6, get_B())); cycles = 8; break;
-        case 0xF1: set_C(SET(6, get_C())); cycles = 8; break;
-        case 0xF2: set_D(SET(6, get_D())); cycles = 8; break;
-        case 0xF3: set_E(SET(6, get_E())); cycles = 8; break;
-        case 0xF4: set_H(SET(6, get_H())); cycles = 8; break;
-        case 0xF5: set_L(SET(6, get_L())); cycles = 8; break;
-        case 0xF6: mem.ld(SET(6, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xF7: set_A(SET(6, get_A())); cycles = 8; break;
-        case 0xF8: set_B(SET(7, get_B())); cycles = 8; break;
-        case 0xF9: set_C(SET(7, get_C())); cycles = 8; break;
-        case 0xFA: set_D(SET(7, get_D())); cycles = 8; break;
-        case 0xFB: set_E(SET(7, get_E())); cycles = 8; break;
-        case 0xFC: set_H(SET(7, get_H())); cycles = 8; break;
-        case 0xFD: set_L(SET(7, get_L())); cycles = 8; break;
-        case 0xFE: mem.ld(SET(7, mem.rd(HL)), HL); cycles = 16; break; 
-        case 0xFF: set_A(SET(7, get_A())); cycles = 8; break;
-
-
-        default:
-            break;
-    }
+template<class Bus>
+void basic_cpu<Bus>::PREFIXED(uint8_t cb_opcode) {
+
+#ifdef CPU_COMPUTED_GOTO
+
+    static const void* const cb_labels[256] = {
+        #define CB(code, ...) &&cb_##code,
+        #include "opcodes.inc"
+    };
+
+    goto *cb_labels[cb_opcode];
+
+    #define CB(code, ...) cb_##code: { __VA_ARGS__ } return;
+    #include "opcodes.inc"
+
+#else
+
+    (this->*dispatch_tables<Bus>::cb[cb_opcode])();
+#endif
 }
 
-uint8_t cpu::AND(uint8_t a, uint8_t b) {
+template<class Bus>
+void basic_cpu<Bus>::unknown_opcode() {
+    std::cout << "UNKNOWN OPCODE: " << std::hex << +opcode << "\n";
+    PC++;
+}
+
+template<class Bus>
+uint8_t basic_cpu<Bus>::AND(uint8_t a, uint8_t b) {
     uint8_t result = a & b;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_AND, a, b, result);
+    write_CF(false);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(true);
     set_CF(false);
-
+#endif
     return result;
 }
 
-uint8_t cpu::OR(uint8_t a, uint8_t b) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::OR(uint8_t a, uint8_t b) {
     uint8_t result = a | b;
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_LOGIC, a, b, result);
+    write_CF(false);
+#else
     set_ZF(result == 0);
     set_CF(false);
     set_NF(false);
     set_HF(false);
-
+#endif
     return result;
 }
 
-uint8_t cpu::XOR(uint8_t a, uint8_t b) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::XOR(uint8_t a, uint8_t b) {
     uint8_t result = a ^ b;
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_LOGIC, a, b, result);
+    write_CF(false);
+#else
     set_ZF(result == 0);
     set_CF(false);
     set_NF(false);
     set_HF(false);
+#endif
 
     return result;
 }
 
-void cpu::BIT(int bit, uint8_t reg) {
+template<class Bus>
+void basic_cpu<Bus>::BIT(int bit, uint8_t reg) {
     uint8_t result = (reg >> bit) & 0x1;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_BIT, reg, bit, result);
+#else
     uint8_t flags = get_F();
     flags &= ~nf;
     flags |= hf;
@@ -743,15 +400,18 @@ void cpu::BIT(int bit, uint8_t reg) {
     }
 
     set_F(flags);
+#endif
 }
 
-void cpu::PUSH(uint16_t addr) {
+template<class Bus>
+void basic_cpu<Bus>::PUSH(uint16_t addr) {
     SP -= 2;
     mem.ld(addr & 0xFF, SP);     
     mem.ld(addr >> 8, SP + 1);
 }
 
-void cpu::PUSH_AF() {
+template<class Bus>
+void basic_cpu<Bus>::PUSH_AF() {
 
     uint8_t flags = (get_ZF() << 7) | (get_NF() << 6) | (get_HF() << 5) | (get_CF() << 4);
 
@@ -761,7 +421,8 @@ void cpu::PUSH_AF() {
     mem.ld(flags & 0xF0, SP);
 }
 
-void cpu::POP_AF() {
+template<class Bus>
+void basic_cpu<Bus>::POP_AF() {
 
     uint8_t lowByte = mem.rd(SP);
 
@@ -775,7 +436,8 @@ void cpu::POP_AF() {
 
 }
 
-void cpu::POP(uint16_t& reg) {
+template<class Bus>
+void basic_cpu<Bus>::POP(uint16_t& reg) {
 
     uint8_t low = mem.rd(SP);
     SP++;
@@ -785,72 +447,102 @@ void cpu::POP(uint16_t& reg) {
 
 }
 
-uint8_t cpu::RL(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::RL(uint8_t byte) {
     uint8_t carryBit = (get_F() & cf) >> 4;
     uint8_t carryFlag = (byte >> 7) & 0x1;
     uint8_t resultByte = (byte << 1) | carryBit;
     
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, resultByte);
+    write_CF(carryFlag != 0);
+#else
     set_ZF(resultByte == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryFlag != 0);
+#endif
     
     return resultByte;
 }
 
-uint8_t cpu::RR(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::RR(uint8_t byte) {
     uint8_t carryBit = (get_F() & cf) << 3;
     uint8_t carryFlag = byte & 0x1;
     uint8_t resultByte = (byte >> 1) | carryBit;
     
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, resultByte);
+    write_CF(carryFlag != 0);
+#else
     set_ZF(resultByte == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryFlag != 0);
+#endif
     
     return resultByte;
 }
 
-uint8_t cpu::RLC(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::RLC(uint8_t byte) {
     uint8_t carryBit = byte >> 7;
     uint8_t carryFlag = (byte >> 3) & cf;
     uint8_t resultByte = (byte << 1) | carryBit;
     
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, resultByte);
+    write_CF(carryFlag != 0);
+#else
     set_ZF(resultByte == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryFlag != 0);
+#endif
     
     return resultByte;
 }
 
-uint8_t cpu::RRC(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::RRC(uint8_t byte) {
     uint8_t carryBit = byte << 7;
     uint8_t carryFlag = (byte << 4) & cf;
     uint8_t resultByte = (byte >> 1) | carryBit;
     
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, resultByte);
+    write_CF(carryFlag != 0);
+#else
     set_ZF(resultByte == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryFlag != 0);
+#endif
     
     return resultByte;
 }
 
-uint8_t cpu::SRL(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::SRL(uint8_t byte) {
 
     uint8_t carryBit = byte & 0x1;
     uint8_t result = byte >> 1;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, result);
+    write_CF(carryBit);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryBit);
-
+#endif
     return result;
 }
 
-uint8_t cpu::SRA(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::SRA(uint8_t byte) {
 
     uint8_t bit_7 = (byte >> 7) & 0x1;
     uint8_t carryBit = byte & 0x1;
@@ -858,114 +550,165 @@ uint8_t cpu::SRA(uint8_t byte) {
 
     result |= (bit_7 << 7);
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, result);
+    write_CF(carryBit);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryBit);
+#endif
 
     return result;
 }
 
-uint8_t cpu::SLA(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::SLA(uint8_t byte) {
 
     uint8_t carryBit = (byte >> 7) & 0x1;
     uint8_t result = byte << 1;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, byte, 0, result);
+    write_CF(carryBit);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(false);
     set_CF(carryBit);
+#endif
 
     return result;
 }
 
 
-uint8_t cpu::INC(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::INC(uint8_t byte) {
 
     uint8_t result = byte + 1;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_INC, byte, 0, result);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF((byte & 0x0F) == 0x0F);
-
+#endif
     return result;
 }
 
-uint8_t cpu::DEC(uint8_t byte) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::DEC(uint8_t byte) {
 
     uint8_t result = byte - 1;
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_DEC, byte, 0, result);
+#else
     set_ZF(result == 0);
     set_NF(true);
     set_HF((byte & 0x0F) == 0x00); 
-
+#endif
     return result;
 }
 
-void cpu::CP(uint8_t a, uint8_t b) {
+template<class Bus>
+void basic_cpu<Bus>::CP(uint8_t a, uint8_t b) {
     uint8_t result = a - b;
     
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SUB, a, b, result);
+    write_CF(b > a);
+#else
     set_ZF(result == 0);
     set_NF(true);
     set_HF((a & 0x0F) < (b & 0x0F));
     set_CF(b > a);
+#endif
 }
 
-void cpu::ADD8(uint8_t byte) {
+template<class Bus>
+void basic_cpu<Bus>::ADD8(uint8_t byte) {
 
     uint16_t result16 = get_A() + byte;
     uint8_t result = get_A() + byte;
     uint8_t original_A = get_A(); 
     set_A(result);
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_ADD, original_A, byte, result);
+    write_CF(result16 > 0xFF);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(((original_A & 0x0F) + (byte & 0x0F)) > 0x0F);  // Half-carry
     set_CF(result16 > 0xFF);    
+#endif
 }
 
-void cpu::ADC(uint8_t byte) {
+template<class Bus>
+void basic_cpu<Bus>::ADC(uint8_t byte) {
 
     uint8_t original_A = get_A(); 
-    uint16_t result16 = get_A() + byte + get_CF();
+    uint8_t carry_in = get_CF();
+    uint16_t result16 = get_A() + byte + carry_in;
     uint8_t result = static_cast<uint8_t>(result16);
     set_A(result);
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_ADC, original_A, byte, result, carry_in);
+    write_CF(result16 > 0xFF);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(((original_A & 0x0F) + (byte & 0x0F) + get_CF()) > 0x0F);
     set_CF(result16 > 0xFF);
-
+#endif
 }
 
-void cpu::SBC(uint8_t byte) {
+template<class Bus>
+void basic_cpu<Bus>::SBC(uint8_t byte) {
 
     uint8_t original_A = get_A(); 
-    uint16_t subtrahend = byte + get_CF();
+    uint8_t carry_in = get_CF();
+    uint16_t subtrahend = byte + carry_in;
     uint16_t wide_result = original_A - subtrahend;
     uint8_t result = (uint8_t)wide_result; 
 
     set_A(result);
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SBC, original_A, byte, result, carry_in);
+    write_CF(original_A < subtrahend);
+#else
     set_ZF(result == 0);
     set_NF(true);
     set_HF((original_A & 0x0F) < ((byte & 0x0F) + get_CF())); 
     set_CF(original_A < subtrahend);
+#endif
 }
 
-void cpu::SUB(uint8_t byte) {
+template<class Bus>
+void basic_cpu<Bus>::SUB(uint8_t byte) {
 
     uint8_t original_A = get_A(); 
     uint8_t result = get_A() - byte;
     set_A(result);
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SUB, original_A, byte, result);
+    write_CF(byte > original_A);
+#else
     set_ZF(result == 0);
     set_NF(true);
     set_HF((original_A & 0x0F) < (byte & 0x0F));
     set_CF(byte > original_A);
+#endif
 }
 
-uint16_t cpu::SPADD(uint8_t byte) {
+template<class Bus>
+uint16_t basic_cpu<Bus>::SPADD(uint8_t byte) {
 
     uint8_t sp_low = SP & 0xFF;
     int32_t result = SP + static_cast<int8_t>(byte);
@@ -973,27 +716,38 @@ uint16_t cpu::SPADD(uint8_t byte) {
 
     
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SPADD, sp_low, byte, 0);
+    write_CF(low_result > 0xFF);
+#else
     set_ZF(false);
     set_NF(false);
     set_HF((sp_low & 0x0F) + (byte & 0x0F) > 0x0F);
     set_CF(low_result > 0xFF);
-
+#endif
     return static_cast<uint16_t>(result);
 }
 
-uint32_t cpu::ADD16(uint16_t a, uint16_t b) {
+template<class Bus>
+uint32_t basic_cpu<Bus>::ADD16(uint16_t a, uint16_t b) {
     uint32_t result = a + b;
 
+#ifdef CPU_LAZY_FLAGS
+    flush_flags(); //Z is kept from the previous op
+    defer_flags(LAZY_ADD16, a, b, 0);
+    write_CF(result > 0xFFFF);
+#else
     //ZERO FLAG IGNORED
     set_NF(false);
     set_HF(((a & 0x0FFF) + (b & 0x0FFF)) > 0x0FFF);
     set_CF(result > 0xFFFF); 
-    
+#endif    
     return result & 0xFFFF;
 }
 
 
-uint8_t cpu::SWAP(uint8_t reg) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::SWAP(uint8_t reg) {
 
     uint8_t temp;
     uint8_t result;
@@ -1002,24 +756,87 @@ uint8_t cpu::SWAP(uint8_t reg) {
     result = ((reg & 0xF0) >> 4) | temp;
 
 
+#ifdef CPU_LAZY_FLAGS
+    defer_flags(LAZY_SHIFT, reg, 0, result);
+    write_CF(false);
+#else
     set_ZF(result == 0);
     set_NF(false);
     set_HF(false);
     set_CF(false);
-
+#endif
     return result;
 }
 
-uint8_t cpu::RES(uint8_t bit, uint8_t reg) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::RES(uint8_t bit, uint8_t reg) {
     return reg & ~(0x1 << bit);
 }
 
-uint8_t cpu::SET(uint8_t bit, uint8_t reg) {
+template<class Bus>
+uint8_t basic_cpu<Bus>::SET(uint8_t bit, uint8_t reg) {
     return reg | (0x1 << bit);
 }
 
 
-void cpu::DAA() {
+template<class Bus>
+void basic_cpu<Bus>::resolve_flags() {
+
+    //C is always written straight away, only Z, N and H are deferred
+    bool z = AF & zf;
+    bool n = false;
+    bool h = false;
+
+    switch (lazy_op) {
+        case LAZY_ADD:
+            z = lazy_result == 0;
+            h = ((lazy_a & 0x0F) + (lazy_b & 0x0F)) > 0x0F;
+            break;
+        case LAZY_ADC:
+            z = lazy_result == 0;
+            h = ((lazy_a & 0x0F) + (lazy_b & 0x0F) + lazy_carry) > 0x0F;
+            break;
+        case LAZY_SUB:
+            z = lazy_result == 0; n = true;
+            h = (lazy_a & 0x0F) < (lazy_b & 0x0F);
+            break;
+        case LAZY_SBC:
+            z = lazy_result == 0; n = true;
+            h = (lazy_a & 0x0F) < ((lazy_b & 0x0F) + lazy_carry);
+            break;
+        case LAZY_AND:
+            z = lazy_result == 0; h = true;
+            break;
+        case LAZY_LOGIC:
+        case LAZY_SHIFT:
+            z = lazy_result == 0;
+            break;
+        case LAZY_INC:
+            z = lazy_result == 0;
+            h = (lazy_a & 0x0F) == 0x0F;
+            break;
+        case LAZY_DEC:
+            z = lazy_result == 0; n = true;
+            h = (lazy_a & 0x0F) == 0x00;
+            break;
+        case LAZY_BIT:
+            z = lazy_result == 0; h = true;
+            break;
+        case LAZY_ADD16: //Z is kept from the previous op
+            h = ((lazy_a & 0x0FFF) + (lazy_b & 0x0FFF)) > 0x0FFF;
+            break;
+        case LAZY_SPADD:
+            z = false;
+            h = (lazy_a & 0x0F) + (lazy_b & 0x0F) > 0x0F;
+            break;
+    }
+
+    lazy_op = LAZY_NONE;
+    AF = (AF & 0xFF1F) | (z << 7) | (n << 6) | (h << 5);
+}
+
+template<class Bus>
+void basic_cpu<Bus>::DAA() {
 
     uint8_t offset = 0;
     uint8_t a = get_A();
@@ -1058,7 +875,8 @@ void cpu::DAA() {
     set_CF(set_carry);
 }
 
-void cpu::stop(uint8_t n8) {
+template<class Bus>
+void basic_cpu<Bus>::stop(uint8_t n8) {
     if(n8 == 0x00) {
         stopped = true;
     }
@@ -1066,7 +884,8 @@ void cpu::stop(uint8_t n8) {
     mem.ld(0, 0xFF04);
 }
 
-void cpu::halt() {
+template<class Bus>
+void basic_cpu<Bus>::halt() {
     if (IME == 0) {
         if ((mem.rd(0xFFFF) & mem.rd(0xFF0F) != 0)) {
 
@@ -1078,7 +897,8 @@ void cpu::halt() {
     halted = true;
 }
 
-void cpu::handle_interrupts(bool pending) {
+template<class Bus>
+void basic_cpu<Bus>::handle_interrupts(bool pending) {
 
     
     if (IME && pending) {  //if there is a pending interrupt AND interrupt handling is enabled...
@@ -1109,4 +929,9 @@ void cpu::handle_interrupts(bool pending) {
         }
     }
 
-}
\ No newline at end of file
+}
+
+
+template class basic_cpu<mmu_bus>;
+template class basic_cpu<trace_bus>;
+template class basic_cpu<flat_bus>;
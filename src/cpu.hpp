@@ -1,19 +1,65 @@
 #pragma once
 
 #include "mmu.hpp"
+#include "bus.hpp"
+#include "icache.hpp"
+#ifdef CPU_JIT
+#include "jit.hpp"
+#include <array>
+#endif
+#if defined(CPU_JIT) || defined(CPU_FUSION)
+#include <functional>
+#endif
 
 #include <iostream>
 #include <string>
 #include <cstdint>
 
-class cpu {
+//the cpu core, built over one of the buses in bus.hpp
+template<class Bus>
+class basic_cpu {
     private:
 
-        mmu& mem;
+        Bus mem;
 
     public: 
 
-        cpu(mmu& shared_memory) : mem(shared_memory){};
+        typedef Bus bus_type;
+
+        basic_cpu(const Bus& bus) : mem(bus), code_cache(mem.memory()){};
+
+        Bus& bus() { return mem; }
+
+        icache code_cache;
+
+#ifdef CPU_JIT
+        friend class jit;
+
+        jit code_jit{code_cache};
+
+        //plain function per opcode so generated code can call the handlers
+        typedef void (*thunk)(basic_cpu*);
+        static const std::array<thunk, 256> op_thunks;
+
+        //peripherals, batched for translated code: cycles they can run before anything
+        //the cpu could see changes, and catching up on (cycles, instructions) worth
+        //of tick_peripherals calls
+        std::function<int()> peripheral_slack;
+        std::function<void(int, int)> peripheral_catch_up;
+#endif
+
+#if defined(CPU_JIT) || defined(CPU_FUSION)
+        //peripherals, for instructions that run without going back to the main loop
+        std::function<void(int)> peripheral_tick;
+#endif
+
+#ifdef CPU_FUSION
+        int cycle_budget = 0x7FFFFFFF; //cycles left in the frame, fused idioms stop there
+
+        uint64_t fusion_counts[FUSION_COUNT] = {0}; //times each idiom ran, printed on exit
+
+        template<int... OPS> int run_fused(const decoded_instr* instr);
+#endif
 
         bool IME = true;
         bool ime_schedule = false;
@@ -28,10 +74,20 @@ class cpu {
         const uint8_t hf   = 0b00100000; //Half-Carry Flag
         const uint8_t cf   = 0b00010000; //Carry Flag
 
-        const int MAX_ROM_SIZE = 8388608; 
+        const size_t MAX_ROM_SIZE = 8388608;
 
         uint8_t opcode = 0;
 
+        //operand latch, filled before each opcode is dispatched
+        uint16_t n16 = 0;
+        uint8_t  n8  = 0;
+        uint16_t a8  = 0;
+        int8_t   e8  = 0;
+
+        //decoder statistics, shown in the debug overlay
+        uint64_t instructions_executed = 0;
+        uint64_t operand_reads_saved = 0;
+
         int cycles = 0;
 
         //registers
@@ -41,13 +97,27 @@ class cpu {
         uint16_t PC;
         uint16_t SP;
 
+        bool fast_boot = false; //reset() starts at 0x0100 as if the boot rom had run
+
         //methods
         void initialize(std::string rom);
+        void reset();
 
         int execute();
+        bool begin_instruction();
+        void load_operands(const decoded_instr* decoded);
+
+        uint8_t pending = 0; //IE & IF, sampled at the start of the instruction
+
+        //opcode handlers, bodies live in opcodes.inc
+        typedef void (basic_cpu::*handler)();
+        #define OP(code, ...) void op_##code();
+        #define CB(code, ...) void cb_##code();
+        #include "opcodes.inc"
+        void unknown_opcode();
 
         uint8_t get_A() const { return (AF >> 8) & 0xFF; }
-        uint8_t get_F() const { return AF & 0xFF; }
+        uint8_t get_F() { flush_flags(); return AF & 0xFF; }
         uint8_t get_B() const { return (BC >> 8) & 0xFF; }
         uint8_t get_C() const { return BC & 0xFF; }
         uint8_t get_D() const { return (DE >> 8) & 0xFF; }
@@ -55,13 +125,13 @@ class cpu {
         uint8_t get_H() const { return (HL >> 8) & 0xFF; }
         uint8_t get_L() const { return HL & 0xFF; }
 
-        bool get_ZF() { return (AF & zf) != 0; }
-        bool get_NF() { return (AF & nf) != 0; }
-        bool get_HF() { return (AF & hf) != 0; }
-        bool get_CF() { return (AF & cf) != 0; }
+        bool get_ZF() { flush_flags(); return (AF & zf) != 0; }
+        bool get_NF() { flush_flags(); return (AF & nf) != 0; }
+        bool get_HF() { flush_flags(); return (AF & hf) != 0; }
+        bool get_CF() { return (AF & cf) != 0; } //C is never deferred
 
         void set_A(uint8_t value) { AF = (value << 8) | (AF & 0xFF); }
-        void set_F(uint8_t value) { AF = (AF & 0xFF00) | value; }
+        void set_F(uint8_t value) { flush_flags(); AF = (AF & 0xFF00) | value; }
         void set_B(uint8_t value) { BC = (value << 8) | (BC & 0xFF); }
         void set_C(uint8_t value) { BC = (BC & 0xFF00) | value; }
         void set_D(uint8_t value) { DE = (value << 8) | (DE & 0xFF); }
@@ -70,6 +140,7 @@ class cpu {
         void set_L(uint8_t value) { HL = (HL & 0xFF00) | value; }
 
         void set_ZF(bool set) { 
+            flush_flags();
             if (set) {
                 AF |= zf;
             } else {
@@ -78,6 +149,7 @@ class cpu {
         }
 
         void set_NF(bool set) { 
+            flush_flags();
             if (set) {
                 AF |= nf; 
             } else {
@@ -86,6 +158,7 @@ class cpu {
         }
 
         void set_HF(bool set) { 
+            flush_flags();
             if (set) {
                 AF |= hf; 
             } else {
@@ -104,6 +177,36 @@ class cpu {
             AF = (AF & 0xFF00) | f;
         }
 
+        //lazy flags: ALU ops write C straight away and record what they did,
+        //Z, N and H are only computed when something reads them
+        enum lazy_flag_op : uint8_t {
+            LAZY_NONE, LAZY_ADD, LAZY_ADC, LAZY_SUB, LAZY_SBC, LAZY_AND, LAZY_LOGIC,
+            LAZY_INC, LAZY_DEC, LAZY_SHIFT, LAZY_BIT, LAZY_ADD16, LAZY_SPADD
+        };
+
+        uint8_t  lazy_op = LAZY_NONE;
+        uint16_t lazy_a = 0;
+        uint16_t lazy_b = 0;
+        uint8_t  lazy_result = 0;
+        uint8_t  lazy_carry = 0;
+
+#ifdef CPU_LAZY_FLAGS
+        void flush_flags() { if (lazy_op != LAZY_NONE) resolve_flags(); }
+#else
+        void flush_flags() {}
+#endif
+        void resolve_flags();
+
+        void write_CF(bool set) { AF = (AF & ~cf) | (set << 4); }
+
+        void defer_flags(uint8_t op, uint16_t a, uint16_t b, uint8_t result, uint8_t carry = 0) {
+            lazy_op = op;
+            lazy_a = a;
+            lazy_b = b;
+            lazy_result = result;
+            lazy_carry = carry;
+        }
+
         void inc_SP() { SP++; }
         void dec_SP() { SP--; }
         void inc_BC() { BC++; }
@@ -129,7 +232,7 @@ class cpu {
 
 
         //CB opcodes
-        void PREFIXED();
+        void PREFIXED(uint8_t cb_opcode);
         void BIT(int bit, uint8_t reg);
         uint8_t SWAP(uint8_t reg);
         uint8_t RES(uint8_t bit, uint8_t reg);
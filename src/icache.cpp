@@ -0,0 +1,276 @@
+#include "icache.hpp"
+#include "mmu.hpp"
+
+const uint8_t operand_bytes[256] = {
+    0, 2, 0, 0, 0, 0, 1, 0, 2, 0, 0, 0, 0, 0, 1, 0, //0x
+    1, 2, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, //1x
+    1, 2, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, //2x
+    1, 2, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, //3x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //4x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //5x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //6x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //7x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //8x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //9x
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //Ax
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //Bx
+    0, 0, 2, 2, 2, 0, 1, 0, 0, 0, 2, 1, 2, 2, 1, 0, //Cx
+    0, 0, 2, 0, 2, 0, 1, 0, 0, 0, 2, 0, 2, 0, 1, 0, //Dx
+    1, 0, 0, 0, 0, 0, 1, 0, 1, 0, 2, 0, 0, 0, 1, 0, //Ex
+    1, 0, 0, 0, 0, 0, 1, 0, 1, 0, 2, 0, 0, 0, 1, 0, //Fx
+};
+
+template<class... T> constexpr uint8_t count_of(T...) { return sizeof...(T); }
+
+const fusion_pattern fusion_patterns[FUSION_COUNT] = {
+    { "NONE", 0, {} },
+    #define FUSION(name, ...) { #name, count_of(__VA_ARGS__), { __VA_ARGS__ } },
+    #include "fusions.inc"
+};
+
+//jumps, calls, returns, rst, halt and stop all end a basic block
+static bool ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: case 0x76:
+        case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7: case 0xC8: case 0xC9:
+        case 0xCA: case 0xCC: case 0xCD: case 0xCF: case 0xD0: case 0xD2: case 0xD4:
+        case 0xD7: case 0xD8: case 0xD9: case 0xDA: case 0xDC: case 0xDF: case 0xE7:
+        case 0xE9: case 0xEF: case 0xF7: case 0xFF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//io registers that only change with time, reading them has no side effects
+static bool is_polled_register(uint16_t address) {
+    return address == 0xFF04 || address == 0xFF0F || address == 0xFF41 || address == 0xFF44;
+}
+
+//address read by a "LD A,(io); [AND n | CP n]...; JR NZ/Z, start" spin, 0 for any other block
+static uint16_t poll_address(const decoded_block* block, uint16_t end_pc) {
+
+    const std::vector<decoded_instr>& instrs = block->instrs;
+
+    if (instrs.size() < 2) {
+        return 0;
+    }
+
+    uint16_t address;
+    if (instrs[0].opcode == 0xF0) {
+        address = 0xFF00 + instrs[0].operand;
+    } else if (instrs[0].opcode == 0xFA) {
+        address = instrs[0].operand;
+    } else {
+        return 0;
+    }
+
+    for (size_t i = 1; i + 1 < instrs.size(); i++) {
+        if (instrs[i].opcode != 0xE6 && instrs[i].opcode != 0xFE) {
+            return 0;
+        }
+    }
+
+    const decoded_instr& jump = instrs.back();
+    if (jump.opcode != 0x20 && jump.opcode != 0x28) {
+        return 0;
+    }
+    if (static_cast<uint16_t>(end_pc + static_cast<int8_t>(jump.operand)) != block->start) {
+        return 0;
+    }
+
+    return is_polled_register(address) ? address : 0;
+}
+
+#ifdef CPU_FUSION
+//tag the first instruction of every idiom from fusions.inc, idioms never overlap
+static void mark_fusions(decoded_block* block) {
+
+    std::vector<decoded_instr>& instrs = block->instrs;
+
+    for (size_t i = 0; i < instrs.size(); i++) {
+        for (int id = 1; id < FUSION_COUNT; id++) {
+
+            const fusion_pattern& pattern = fusion_patterns[id];
+            if (i + pattern.length > instrs.size()) {
+                continue;
+            }
+
+            bool match = true;
+            for (int j = 0; j < pattern.length; j++) {
+                if (instrs[i + j].opcode != pattern.opcodes[j]) {
+                    match = false;
+                    break;
+                }
+            }
+
+            if (match) {
+                instrs[i].fusion = id;
+                i += pattern.length - 1;
+                break;
+            }
+        }
+    }
+}
+#endif
+
+void icache::reset() {
+    for (auto& bank : banks) {
+        bank.reset();
+    }
+    restart();
+}
+
+//forget where execution was, the decoded blocks stay (same rom, after a reset)
+void icache::restart() {
+    switchable = nullptr;
+    block = nullptr;
+    index = 0;
+}
+
+icache::bank_blocks* icache::blocks_for(uint16_t bank) {
+    if (!banks[bank]) {
+        banks[bank].reset(new bank_blocks());
+    }
+    return banks[bank].get();
+}
+
+decoded_block* icache::decode_block(uint16_t pc) {
+
+    decoded_block* decoded = new decoded_block;
+    decoded->start = pc;
+    int region_end = (pc < 0x4000) ? 0x4000 : 0x8000;
+
+    while (decoded->instrs.size() < MAX_BLOCK_LENGTH) {
+
+        decoded_instr instr;
+        instr.opcode = mem->rd(pc);
+        instr.length = operand_bytes[instr.opcode];
+
+        if (pc + instr.length >= region_end) { //operands would come from another bank
+            break;
+        }
+
+        if (instr.length == 2) {
+            instr.operand = (mem->rd(pc + 2) << 8) | mem->rd(pc + 1);
+        } else if (instr.length == 1) {
+            instr.operand = mem->rd(pc + 1);
+        } else {
+            instr.operand = 0;
+        }
+
+        instr.fusion = FUSION_NONE;
+
+        decoded->instrs.push_back(instr);
+        pc += 1 + instr.length;
+
+        if (ends_block(instr.opcode) || pc >= region_end) {
+            break;
+        }
+    }
+
+    decoded->poll_register = poll_address(decoded, pc);
+
+#ifdef CPU_FUSION
+    mark_fusions(decoded);
+#endif
+
+    return decoded;
+}
+
+//table of blocks for whatever is mapped at pc, nullptr for ram, hram and the boot rom
+icache::bank_blocks* icache::table_for(uint16_t pc) {
+
+    if (!mem || pc >= 0x8000 || (mem->bootRomEnabled && pc <= 0x00FF)) {
+        return nullptr;
+    }
+
+    //a write to the mbc registers may have changed what is mapped at 0x4000
+    if (map_version != mem->rom_map_version) {
+        map_version = mem->rom_map_version;
+        switchable = nullptr;
+        block = nullptr;
+    }
+
+    if (pc < 0x4000) {
+        return blocks_for(mem->rom_bank0);
+    }
+    if (!switchable) {
+        switchable = blocks_for(mem->rom_bank);
+    }
+    return switchable;
+}
+
+//block starting at pc if one has already been decoded
+decoded_block* icache::find(uint16_t pc) {
+
+    bank_blocks* table = table_for(pc);
+
+    if (!table) {
+        return nullptr;
+    }
+    return (*table)[pc & 0x3FFF].get();
+}
+
+//block starting at pc, decoded now if it hasn't been. the interpreter's place in
+//the current block stays as it is
+decoded_block* icache::lookup(uint16_t pc) {
+
+    bank_blocks* table = table_for(pc);
+
+    if (!table) {
+        return nullptr;
+    }
+
+    std::unique_ptr<decoded_block>& slot = (*table)[pc & 0x3FFF];
+    if (!slot) {
+        slot.reset(decode_block(pc));
+        blocks_decoded++;
+    }
+    return slot.get();
+}
+
+//a fused handler ran count more instructions of the current block, pc is where it stopped
+void icache::skip(size_t count, uint16_t pc) {
+    index += count;
+    next_pc = pc;
+}
+
+const decoded_instr* icache::fetch(uint16_t pc) {
+
+    bank_blocks* table = table_for(pc);
+
+    if (!table) { //ram, hram and the boot rom are interpreted
+        block = nullptr;
+        return nullptr;
+    }
+
+    if (mem->dma_blocks(pc)) { //the cpu reads 0xFF off the bus until the transfer is done
+        block = nullptr;
+        return nullptr;
+    }
+
+    if (!block || pc != next_pc || index >= block->instrs.size()) {
+
+        std::unique_ptr<decoded_block>& slot = (*table)[pc & 0x3FFF];
+        if (!slot) {
+            slot.reset(decode_block(pc));
+            blocks_decoded++;
+        }
+
+        block = slot.get();
+        index = 0;
+
+        if (block->instrs.empty()) {
+            block = nullptr;
+            return nullptr;
+        }
+        slot->exec_count++;
+    }
+
+    const decoded_instr* instr = &block->instrs[index++];
+    next_pc = pc + 1 + instr->length;
+    hits++;
+
+    return instr;
+}
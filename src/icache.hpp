@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class mmu;
+
+//operand bytes following each base opcode (0 = none, 1 = n8/a8/e8, 2 = n16)
+extern const uint8_t operand_bytes[256];
+
+//idioms from fusions.inc, FUSION_NONE for plain instructions
+enum fusion_id : uint8_t {
+    FUSION_NONE,
+    #define FUSION(name, ...) FUSION_##name,
+    #include "fusions.inc"
+    FUSION_COUNT
+};
+
+struct fusion_pattern {
+    const char* name;
+    uint8_t length;
+    uint8_t opcodes[4];
+};
+
+extern const fusion_pattern fusion_patterns[FUSION_COUNT];
+
+struct decoded_instr {
+    uint8_t  opcode;
+    uint8_t  length;    //operand bytes, same as operand_bytes[opcode]
+    uint16_t operand;   //n8 or n16, already fetched
+    uint8_t  fusion;    //idiom starting here, only set in fusion builds
+};
+
+struct decoded_block {
+    uint16_t start;
+    std::vector<decoded_instr> instrs;
+
+    uint32_t exec_count = 0;    //times the interpreter entered this block
+    void* native = nullptr;     //translated code, see jit.hpp
+    int native_cycles = 0;      //longest path through it, what it needs from the cycle budget
+    bool interpret_only = false; //the jit can't start it
+    uint16_t poll_register = 0; //io register this block spins on, if it is an idle loop
+};
+
+//predecoded instruction cache for code running out of ROM.
+//blocks are keyed by (rom bank, pc) and run up to the next jump, call,
+//return or halt, so straight-line code never goes back to the decoder.
+//anything outside 0x0000 - 0x7FFF (or in the boot rom) is left to the interpreter.
+class icache {
+    private:
+
+        mmu* mem; //nullptr on buses without an mmu, nothing gets cached then
+
+        static const int BANK_SIZE = 0x4000;
+        static const int MAX_BLOCK_LENGTH = 64;
+
+        typedef std::array<std::unique_ptr<decoded_block>, BANK_SIZE> bank_blocks;
+
+        std::array<std::unique_ptr<bank_blocks>, 512> banks;
+
+        bank_blocks* switchable = nullptr; //blocks for whatever bank is mapped at 0x4000
+        uint32_t map_version = 0;
+
+        const decoded_block* block = nullptr;
+        size_t index = 0;
+        uint16_t next_pc = 0;
+
+        bank_blocks* blocks_for(uint16_t bank);
+        bank_blocks* table_for(uint16_t pc);
+        decoded_block* decode_block(uint16_t pc);
+
+    public:
+
+        icache(mmu* shared_memory) : mem(shared_memory){};
+
+        uint64_t hits = 0;            //instructions served from the cache
+        uint64_t blocks_decoded = 0;
+
+        const decoded_instr* fetch(uint16_t pc);
+        void skip(size_t count, uint16_t pc);
+        decoded_block* find(uint16_t pc);
+        decoded_block* lookup(uint16_t pc);
+
+        //the next fetch at pc starts a rom block instead of carrying on with the current one
+        bool starts_block(uint16_t pc) const {
+            return pc < 0x8000 && (!block || pc != next_pc || index >= block->instrs.size());
+        }
+        void reset();
+        void restart();
+};
@@ -0,0 +1,877 @@
+#include "jit.hpp"
+#include "cpu.hpp"
+
+#include <algorithm>
+#include <cpuid.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#error "the jit backend only emits x86-64 code, build with JIT=0"
+#endif
+
+//the generated code keeps the cpu in rbx, the mmu's read and write page tables in
+//r12 and r13 and hram in r14. rax, rcx, rdx, rsi and rdi are scratch, every guest
+//register lives in the cpu object and is read and written there.
+//
+//x86 condition codes, for jcc
+static const uint8_t CC_AE = 0x3, CC_Z = 0x4, CC_NZ = 0x5, CC_BE = 0x6, CC_G = 0xF;
+
+//register field of an opcode that means (HL)
+static const int HL_INDIRECT = 6;
+
+//upper bound for an instruction that calls its handler (cb ops, ADD SP,e8, ...)
+static const int HANDLER_MAX_CYCLES = 16;
+
+enum native_kind { NOT_NATIVE, INLINE, HANDLER };
+
+//how an instruction gets translated, anything NOT_NATIVE ends the block there
+static native_kind kind_of(const decoded_instr& instr) {
+
+    uint8_t op = instr.opcode;
+
+    if (op >= 0x40 && op <= 0xBF) {
+        return (op == 0x76) ? NOT_NATIVE : INLINE; //HALT
+    }
+
+    switch (op) {
+        case 0x00:                                                  //NOP
+        case 0x01: case 0x11: case 0x21: case 0x31:                 //LD rr,n16
+        case 0x02: case 0x12: case 0x0A: case 0x1A:                 //LD (BC/DE),A  LD A,(BC/DE)
+        case 0x22: case 0x32: case 0x2A: case 0x3A:                 //LD (HL+/-),A  LD A,(HL+/-)
+        case 0x03: case 0x13: case 0x23: case 0x33:                 //INC rr
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:                 //DEC rr
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C: //INC r
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D: //DEC r
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E: //LD r,n8
+        case 0x36:                                                  //LD (HL),n8
+        case 0x2F: case 0x37: case 0x3F:                            //CPL SCF CCF
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE: //ALU A,n8
+        case 0xEA: case 0xFA:                                       //LD (a16),A  LD A,(a16)
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:      //JR
+        case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:      //JP
+        case 0xCD: case 0xC9:                                       //CALL RET
+            return INLINE;
+
+        case 0xE0: case 0xF0: //LDH, only hram, io goes through the mmu
+            return (instr.operand >= 0x80 && instr.operand != 0xFF) ? INLINE : NOT_NATIVE;
+
+        case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27:      //rotate A, DAA
+        case 0x09: case 0x19: case 0x29: case 0x39:                 //ADD HL,rr
+        case 0xE8: case 0xF8: case 0xF9:                            //SP arithmetic
+            return HANDLER;
+
+        case 0xCB: //register forms only, (HL) ones touch memory
+            return ((instr.operand & 7) != HL_INDIRECT) ? HANDLER : NOT_NATIVE;
+
+        default:
+            return NOT_NATIVE;
+    }
+}
+
+//cycles of an inline instruction, same values as opcodes.inc
+static int inline_cycles(uint8_t op, bool taken) {
+
+    if (op >= 0x40 && op <= 0xBF) { //for the alu ops the middle field is the operation
+        bool memory = (op & 7) == HL_INDIRECT || (op < 0x80 && ((op >> 3) & 7) == HL_INDIRECT);
+        return memory ? 8 : 4;
+    }
+
+    switch (op) {
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x36:
+        case 0xE0: case 0xF0:
+            return 12;
+        case 0xEA: case 0xFA: case 0xC9:
+            return 16;
+        case 0xCD:
+            return 24;
+        case 0x18:
+            return 12;
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            return taken ? 12 : 8;
+        case 0xC3:
+            return 16;
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            return taken ? 16 : 12;
+        case 0x00: case 0x2F: case 0x37: case 0x3F:
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+//a patched jump can only go where the source's bank table is still the one mapped
+static bool same_region(uint16_t from, uint16_t to) {
+    return to < 0x8000 && (from < 0x4000) == (to < 0x4000);
+}
+
+static int32_t offset_in(const cpu& gb, const void* field) {
+    return static_cast<int32_t>(static_cast<const uint8_t*>(field) - reinterpret_cast<const uint8_t*>(&gb));
+}
+
+
+jit::~jit() {
+    if (code) {
+        munmap(code, CODE_SIZE);
+    }
+}
+
+void jit::reset() {
+    used = 0;
+    full = false;
+    enter_stub = nullptr;
+    exit_stub = nullptr;
+    dispatch_stub = nullptr;
+    link_stub = nullptr;
+}
+
+void jit::emit32(uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit((value >> (i * 8)) & 0xFF);
+    }
+}
+
+void jit::emit64(uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit((value >> (i * 8)) & 0xFF);
+    }
+}
+
+//modrm and disp32 for [rbx + offset]
+void jit::emit_rbx(uint8_t reg, int32_t offset) {
+    emit(0x83 | (reg << 3));
+    emit32(offset);
+}
+
+void jit::emit_call(const void* target) {
+    emit(0x48); emit(0x89); emit(0xDF);                                  //mov rdi, rbx
+    emit(0x48); emit(0xB8); emit64(reinterpret_cast<uint64_t>(target)); //mov rax, target
+    emit(0xFF); emit(0xD0);                                              //call rax
+}
+
+//rel32 to an address that is already in the code buffer
+void jit::emit_jump(const uint8_t* target) {
+    const uint8_t* end = code + used + buffer.size() + 4;
+    emit32(static_cast<uint32_t>(target - end));
+}
+
+//jcc / jmp rel32 to somewhere later in this block, returns what to bind()
+size_t jit::emit_jcc(uint8_t condition) {
+    emit(0x0F); emit(0x80 | condition);
+    emit32(0);
+    return buffer.size() - 4;
+}
+
+size_t jit::emit_jmp() {
+    emit(0xE9);
+    emit32(0);
+    return buffer.size() - 4;
+}
+
+//point a jump from emit_jcc / emit_jmp at the code emitted next
+void jit::bind(size_t fixup) {
+    uint32_t rel = static_cast<uint32_t>(buffer.size() - (fixup + 4));
+    std::memcpy(&buffer[fixup], &rel, 4);
+}
+
+//host pointer for the guest address in ecx into rdx, through the read (r12) or
+//write (r13) page table and then hram. anything else is left to the mmu, the
+//jump to the side exit is added to misses. clobbers ecx
+void jit::emit_resolve(bool write, std::vector<size_t>& misses) {
+
+    //vram is mapped or not by ppu mode, which only catches up after the block
+    emit(0x8D); emit(0x91); emit32(static_cast<uint32_t>(-0x8000)); //lea edx, [rcx - 0x8000]
+    emit(0x81); emit(0xFA); emit32(0x1FFF);                     //cmp edx, 0x1FFF
+    misses.push_back(emit_jcc(CC_BE));                          //jbe miss
+    emit(0x89); emit(0xCA);                                     //mov edx, ecx
+    emit(0xC1); emit(0xEA); emit(0x08);                         //shr edx, 8
+    if (write) {
+        emit(0x49); emit(0x8B); emit(0x54); emit(0xD5); emit(0x00); //mov rdx, [r13 + rdx * 8]
+    } else {
+        emit(0x49); emit(0x8B); emit(0x14); emit(0xD4);         //mov rdx, [r12 + rdx * 8]
+    }
+    emit(0x48); emit(0x85); emit(0xD2);                         //test rdx, rdx
+    emit(0x74); emit(0x08);                                     //jz hram
+    emit(0x0F); emit(0xB6); emit(0xC9);                         //movzx ecx, cl
+    emit(0x48); emit(0x01); emit(0xCA);                         //add rdx, rcx
+    emit(0xEB); emit(0x13);                                     //jmp done
+    //hram:
+    emit(0x8D); emit(0x91); emit32(static_cast<uint32_t>(-0xFF80)); //lea edx, [rcx - 0xFF80]
+    emit(0x83); emit(0xFA); emit(0x7F);                         //cmp edx, 0x7F
+    misses.push_back(emit_jcc(CC_AE));                          //jae miss
+    emit(0x49); emit(0x8D); emit(0x14); emit(0x16);             //lea rdx, [r14 + rdx]
+    //done:
+}
+
+//F = new flags in dl | (F & keep), the flags are fully known after this
+void jit::emit_store_flags(uint8_t keep) {
+
+    emit(0x0F); emit(0xB6); emit_rbx(1, at.F);                  //movzx ecx, byte [F]
+    emit(0x80); emit(0xE1); emit(keep);                         //and cl, keep
+    emit(0x08); emit(0xCA);                                     //or dl, cl
+    emit(0x88); emit_rbx(2, at.F);                              //mov [F], dl
+#ifdef CPU_LAZY_FLAGS
+    emit(0xC6); emit_rbx(0, at.lazy_op); emit(0);               //mov byte [lazy_op], LAZY_NONE
+#endif
+}
+
+//Z and H (and C) from the x86 flags of the last add / sub / inc / dec, plus set
+void jit::emit_lahf_flags(uint8_t set, uint8_t keep, bool carry) {
+
+    emit(0x9F);                                                 //lahf
+    emit(0x88); emit(0xE2);                                     //mov dl, ah
+    emit(0x80); emit(0xE2); emit(0x50);                         //and dl, ZF | AF
+    emit(0x00); emit(0xD2);                                     //add dl, dl (to Z and H)
+    if (carry) {
+        emit(0x88); emit(0xE1);                                 //mov cl, ah
+        emit(0x80); emit(0xE1); emit(0x01);                     //and cl, CF
+        emit(0xC0); emit(0xE1); emit(0x04);                     //shl cl, 4 (to C)
+        emit(0x08); emit(0xCA);                                 //or dl, cl
+    }
+    if (set) {
+        emit(0x80); emit(0xCA); emit(set);                      //or dl, set
+    }
+    emit_store_flags(keep);
+}
+
+//Z from al, plus set, for AND / XOR / OR
+void jit::emit_logic_flags(uint8_t set) {
+
+    emit(0x84); emit(0xC0);                                     //test al, al
+    emit(0x0F); emit(0x94); emit(0xC2);                         //sete dl
+    emit(0xC0); emit(0xE2); emit(0x07);                         //shl dl, 7 (to Z)
+    if (set) {
+        emit(0x80); emit(0xCA); emit(set);                      //or dl, set
+    }
+    emit_store_flags(0x0F);
+}
+
+//opcode and cycles of the last instruction run, as the interpreter leaves them.
+//cycles < 0 when that was a handler, which has set them itself
+void jit::emit_last(uint8_t op, int cycles) {
+
+    emit(0xC6); emit_rbx(0, at.opcode); emit(op);               //mov byte [opcode], op
+    if (cycles >= 0) {
+        emit(0xC7); emit_rbx(0, at.cycles); emit32(cycles);     //mov dword [cycles], cycles
+    }
+}
+
+//leave the block for target: straight to its code once that is translated (the
+//jump gets patched by link), otherwise through the dispatcher
+void jit::emit_exit(uint16_t start, uint16_t target, int cycles, int instrs, uint8_t last_op, int last_cycles, std::vector<exit_ref>& links) {
+
+    emit_last(last_op, last_cycles);
+    emit(0x81); emit_rbx(0, at.window_cycles); emit32(cycles);  //add [window_cycles], cycles
+    emit(0x81); emit_rbx(0, at.window_instrs); emit32(instrs);  //add [window_instrs], instrs
+
+    if (same_region(start, target)) {
+        links.push_back({emit_jmp(), target, cycles, instrs, last_op, last_cycles}); //jmp link stub, patched later
+    } else {
+        emit(0x66); emit(0xC7); emit_rbx(0, at.PC);             //mov word [PC], target
+        emit(target & 0xFF); emit(target >> 8);
+        emit(0xE9); emit_jump(dispatch_stub);                   //jmp dispatch
+    }
+}
+
+//copy the buffer into executable memory
+//the code buffer is never writable and executable at the same time, the pages a
+//write touches are flipped to writable only for the copy
+bool jit::write_code(uint8_t* to, const void* from, size_t size) {
+
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    uint8_t* first = code + ((to - code) & ~(page_size - 1));
+    size_t length = static_cast<size_t>(to + size - first);
+
+    if (mprotect(first, length, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    std::memcpy(to, from, size);
+    return mprotect(first, length, PROT_READ | PROT_EXEC) == 0;
+}
+
+uint8_t* jit::commit() {
+
+    if (full || used + buffer.size() > CODE_SIZE) {
+        full = true;
+        buffer.clear();
+        return nullptr;
+    }
+
+    uint8_t* start = code + used;
+    if (!write_code(start, buffer.data(), buffer.size())) {
+        std::cout << "JIT: could not write to the code buffer, staying on the interpreter\n";
+        full = true;
+        buffer.clear();
+        return nullptr;
+    }
+    used += buffer.size();
+    buffer.clear();
+
+    return start;
+}
+
+bool jit::emit_stubs(cpu& gb) {
+
+    //lahf in 64 bit mode is missing on a few of the very first x86-64 cpus
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(ecx & 1)) {
+        std::cout << "JIT: this cpu has no LAHF in 64 bit mode, staying on the interpreter\n";
+        full = true;
+        return false;
+    }
+
+    if (!code) {
+        void* mapped = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            std::cout << "JIT: could not map executable memory, staying on the interpreter\n";
+            full = true;
+            return false;
+        }
+        code = static_cast<uint8_t*>(mapped);
+    }
+
+    at.reg8[0] = offset_in(gb, &gb.BC) + 1;
+    at.reg8[1] = offset_in(gb, &gb.BC);
+    at.reg8[2] = offset_in(gb, &gb.DE) + 1;
+    at.reg8[3] = offset_in(gb, &gb.DE);
+    at.reg8[4] = offset_in(gb, &gb.HL) + 1;
+    at.reg8[5] = offset_in(gb, &gb.HL);
+    at.reg8[6] = 0;
+    at.reg8[7] = offset_in(gb, &gb.AF) + 1;
+    at.F  = offset_in(gb, &gb.AF);
+    at.BC = offset_in(gb, &gb.BC);
+    at.DE = offset_in(gb, &gb.DE);
+    at.HL = offset_in(gb, &gb.HL);
+    at.SP = offset_in(gb, &gb.SP);
+    at.PC = offset_in(gb, &gb.PC);
+    at.opcode  = offset_in(gb, &gb.opcode);
+    at.cycles  = offset_in(gb, &gb.cycles);
+    at.n8      = offset_in(gb, &gb.n8);
+    at.lazy_op = offset_in(gb, &gb.lazy_op);
+    at.window_cycles = offset_in(gb, &window_cycles);
+    at.window_instrs = offset_in(gb, &window_instrs);
+    at.window_budget = offset_in(gb, &window_budget);
+
+    mmu* mem = gb.bus().memory();
+
+    buffer.clear();
+
+    //enter(cpu* gb, void* entry). five pushes keep the stack 16 byte aligned for calls
+    emit(0x53);                                     //push rbx
+    emit(0x41); emit(0x54);                         //push r12
+    emit(0x41); emit(0x55);                         //push r13
+    emit(0x41); emit(0x56);                         //push r14
+    emit(0x41); emit(0x57);                         //push r15
+    emit(0x48); emit(0x89); emit(0xFB);             //mov rbx, rdi
+    emit(0x49); emit(0xBC); emit64(reinterpret_cast<uint64_t>(mem->read_page));  //mov r12, read_page
+    emit(0x49); emit(0xBD); emit64(reinterpret_cast<uint64_t>(mem->write_page)); //mov r13, write_page
+    emit(0x49); emit(0xBE); emit64(reinterpret_cast<uint64_t>(mem->HRAM));       //mov r14, HRAM
+    emit(0xFF); emit(0xE6);                         //jmp rsi
+    enter_stub = commit();
+
+    emit(0x41); emit(0x5F);                         //pop r15
+    emit(0x41); emit(0x5E);                         //pop r14
+    emit(0x41); emit(0x5D);                         //pop r13
+    emit(0x41); emit(0x5C);                         //pop r12
+    emit(0x5B);                                     //pop rbx
+    emit(0xC3);                                     //ret
+    exit_stub = commit();
+
+    emit_call(reinterpret_cast<const void*>(&jit::next));
+    emit(0x48); emit(0x85); emit(0xC0);             //test rax, rax
+    emit(0x0F); emit(0x84); emit_jump(exit_stub);   //jz exit
+    emit(0xFF); emit(0xE0);                         //jmp rax
+    dispatch_stub = commit();
+
+    emit_call(reinterpret_cast<const void*>(&jit::link)); //site already in rsi
+    emit(0x48); emit(0x85); emit(0xC0);             //test rax, rax
+    emit(0x0F); emit(0x84); emit_jump(exit_stub);   //jz exit
+    emit(0xFF); emit(0xE0);                         //jmp rax
+    link_stub = commit();
+
+    return link_stub != nullptr;
+}
+
+bool jit::translate(cpu& gb, decoded_block* block) {
+
+    if (!link_stub && !emit_stubs(gb)) {
+        return false;
+    }
+
+    const std::vector<decoded_instr>& instrs = block->instrs;
+    const uint16_t start = block->start;
+
+    if (kind_of(instrs[0]) == NOT_NATIVE) {
+        return false;
+    }
+
+    std::vector<exit_ref> side_exits;   //back to the interpreter for one instruction
+    std::vector<exit_ref> links;        //static targets, through link stubs
+
+    buffer.clear();
+
+    //the longest path through the block has to fit in what the peripherals allow
+    emit(0x8B); emit_rbx(0, at.window_cycles);          //mov eax, [window_cycles]
+    size_t max_cycles_at = buffer.size() + 1;
+    emit(0x05); emit32(0);                              //add eax, max cycles
+    emit(0x3B); emit_rbx(0, at.window_budget);          //cmp eax, [window_budget]
+    size_t over_budget = emit_jcc(CC_G);
+
+    uint16_t pc = start;
+    int cycles = 0;         //inline cycles so far, handlers add theirs as they run
+    int max_cycles = 0;
+    int count = 0;
+    uint8_t last_op = 0;
+    int last_cycles = 0;
+    bool ended = false;
+#ifdef CPU_LAZY_FLAGS
+    bool flags_known = false; //no deferred Z / N / H left from the interpreter
+#endif
+
+    for (const decoded_instr& instr : instrs) {
+
+        native_kind kind = kind_of(instr);
+        uint8_t op = instr.opcode;
+        uint16_t next_pc = pc + 1 + instr.length;
+        std::vector<size_t> misses;
+
+        if (kind == NOT_NATIVE) {
+            side_exits.push_back({emit_jmp(), pc, cycles, count, last_op, last_cycles});
+            ended = true;
+            break;
+        }
+
+#ifdef CPU_LAZY_FLAGS
+        //instructions that keep some of Z / N / H need them resolved first
+        bool reads_flags = op == 0x2F || op == 0x37 || op == 0x3F ||
+                           op == 0x20 || op == 0x28 || op == 0xC2 || op == 0xCA;
+        if (reads_flags && !flags_known) {
+            emit(0x80); emit_rbx(7, at.lazy_op); emit(0);   //cmp byte [lazy_op], LAZY_NONE
+            misses.push_back(emit_jcc(CC_NZ));
+            flags_known = true;
+        }
+#endif
+
+        if (kind == HANDLER) {
+
+            if (instr.length == 1) {
+                emit(0xC6); emit_rbx(0, at.n8); emit(instr.operand);    //mov byte [n8], operand
+            }
+            emit_call(reinterpret_cast<const void*>(cpu::op_thunks[op]));
+            emit(0x8B); emit_rbx(0, at.cycles);                         //mov eax, [cycles]
+            emit(0x01); emit_rbx(0, at.window_cycles);                  //add [window_cycles], eax
+
+            max_cycles += HANDLER_MAX_CYCLES;
+            count++;
+            last_op = op;
+            last_cycles = -1;
+#ifdef CPU_LAZY_FLAGS
+            flags_known = false;
+#endif
+            pc = next_pc;
+            continue;
+        }
+
+        int src = op & 7;
+        int dst = (op >> 3) & 7;
+
+        if (op >= 0x40 && op <= 0x7F) {                     //LD r,r'
+
+            if (src == HL_INDIRECT) {
+                emit(0x0F); emit(0xB7); emit_rbx(1, at.HL);             //movzx ecx, word [HL]
+                emit_resolve(false, misses);
+                emit(0x0F); emit(0xB6); emit(0x02);                     //movzx eax, byte [rdx]
+                emit(0x88); emit_rbx(0, at.reg8[dst]);                  //mov [dst], al
+            } else if (dst == HL_INDIRECT) {
+                emit(0x0F); emit(0xB7); emit_rbx(1, at.HL);             //movzx ecx, word [HL]
+                emit_resolve(true, misses);
+                emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[src]);      //movzx eax, byte [src]
+                emit(0x88); emit(0x02);                                 //mov [rdx], al
+            } else if (src != dst) {
+                emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[src]);      //movzx eax, byte [src]
+                emit(0x88); emit_rbx(0, at.reg8[dst]);                  //mov [dst], al
+            }
+
+        } else if ((op >= 0x80 && op <= 0xBF) || (op & 0xC7) == 0xC6) { //ALU A,r / A,n8
+
+            int alu = dst;
+
+            if (op >= 0xC0) {
+                emit(0xB1); emit(instr.operand);                        //mov cl, n8
+            } else if (src == HL_INDIRECT) {
+                emit(0x0F); emit(0xB7); emit_rbx(1, at.HL);             //movzx ecx, word [HL]
+                emit_resolve(false, misses);
+                emit(0x0F); emit(0xB6); emit(0x0A);                     //movzx ecx, byte [rdx]
+            } else {
+                emit(0x0F); emit(0xB6); emit_rbx(1, at.reg8[src]);      //movzx ecx, byte [src]
+            }
+            emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[7]);            //movzx eax, byte [A]
+
+            if (alu == 1 || alu == 3) {                                 //ADC / SBC take C in
+                emit(0x0F); emit(0xB6); emit_rbx(2, at.F);              //movzx edx, byte [F]
+                emit(0x0F); emit(0xBA); emit(0xE2); emit(0x04);         //bt edx, 4
+            }
+
+            static const uint8_t x86_alu[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38}; //add adc sub sbb and xor or cmp
+            emit(x86_alu[alu]); emit(0xC8);                             //op al, cl
+
+            switch (alu) {
+                case 0: case 1: emit_lahf_flags(0x00, 0x0F, true); break;
+                case 2: case 3: case 7: emit_lahf_flags(0x40, 0x0F, true); break;
+                case 4: emit_logic_flags(0x20); break;
+                default: emit_logic_flags(0x00); break;
+            }
+            if (alu != 7) {
+                emit(0x88); emit_rbx(0, at.reg8[7]);                    //mov [A], al
+            }
+#ifdef CPU_LAZY_FLAGS
+            flags_known = true;
+#endif
+
+        } else if ((op & 0xC6) == 0x04 && dst != HL_INDIRECT) {    //INC r / DEC r
+
+            bool dec = op & 1;
+            emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[dst]);          //movzx eax, byte [r]
+            emit(0xFE); emit(dec ? 0xC8 : 0xC0);                        //dec al / inc al
+            emit_lahf_flags(dec ? 0x40 : 0x00, 0x1F, false);
+            emit(0x88); emit_rbx(0, at.reg8[dst]);                      //mov [r], al
+#ifdef CPU_LAZY_FLAGS
+            flags_known = true;
+#endif
+
+        } else if ((op & 0xC7) == 0x06 && dst != HL_INDIRECT) {    //LD r,n8
+
+            emit(0xC6); emit_rbx(0, at.reg8[dst]); emit(instr.operand);  //mov byte [r], n8
+
+        } else {
+
+            const int32_t at_pair[4] = {at.BC, at.DE, at.HL, at.SP};
+            int32_t pair = at_pair[op >> 4 & 3];
+
+            switch (op) {
+                case 0x00:
+                    break;
+
+                case 0x01: case 0x11: case 0x21: case 0x31:             //LD rr,n16
+                    emit(0x66); emit(0xC7); emit_rbx(0, pair);
+                    emit(instr.operand & 0xFF); emit(instr.operand >> 8);
+                    break;
+
+                case 0x03: case 0x13: case 0x23: case 0x33:             //INC rr
+                    emit(0x66); emit(0xFF); emit_rbx(0, pair);
+                    break;
+
+                case 0x0B: case 0x1B: case 0x2B: case 0x3B:             //DEC rr
+                    emit(0x66); emit(0xFF); emit_rbx(1, pair);
+                    break;
+
+                case 0x02: case 0x12: case 0x22: case 0x32:             //LD (rr),A
+                    emit(0x0F); emit(0xB7); emit_rbx(1, op >= 0x20 ? at.HL : pair); //movzx ecx, word [rr]
+                    emit_resolve(true, misses);
+                    emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[7]);    //movzx eax, byte [A]
+                    emit(0x88); emit(0x02);                             //mov [rdx], al
+                    if (op == 0x22 || op == 0x32) {
+                        emit(0x66); emit(0xFF); emit_rbx(op == 0x22 ? 0 : 1, at.HL); //inc / dec word [HL]
+                    }
+                    break;
+
+                case 0x0A: case 0x1A: case 0x2A: case 0x3A:             //LD A,(rr)
+                    emit(0x0F); emit(0xB7); emit_rbx(1, op >= 0x20 ? at.HL : pair);
+                    emit_resolve(false, misses);
+                    emit(0x0F); emit(0xB6); emit(0x02);                 //movzx eax, byte [rdx]
+                    emit(0x88); emit_rbx(0, at.reg8[7]);                //mov [A], al
+                    if (op == 0x2A || op == 0x3A) {
+                        emit(0x66); emit(0xFF); emit_rbx(op == 0x2A ? 0 : 1, at.HL);
+                    }
+                    break;
+
+                case 0x36:                                              //LD (HL),n8
+                    emit(0x0F); emit(0xB7); emit_rbx(1, at.HL);
+                    emit_resolve(true, misses);
+                    emit(0xC6); emit(0x02); emit(instr.operand);        //mov byte [rdx], n8
+                    break;
+
+                case 0xEA: case 0xFA:                                   //LD (a16),A  LD A,(a16)
+                    emit(0xB9); emit32(instr.operand);                  //mov ecx, a16
+                    emit_resolve(op == 0xEA, misses);
+                    if (op == 0xEA) {
+                        emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[7]);
+                        emit(0x88); emit(0x02);
+                    } else {
+                        emit(0x0F); emit(0xB6); emit(0x02);
+                        emit(0x88); emit_rbx(0, at.reg8[7]);
+                    }
+                    break;
+
+                case 0xE0:                                              //LDH (a8),A, hram
+                    emit(0x0F); emit(0xB6); emit_rbx(0, at.reg8[7]);
+                    emit(0x41); emit(0x88); emit(0x86); emit32(instr.operand - 0x80);   //mov [r14 + a8 - 0x80], al
+                    break;
+
+                case 0xF0:                                              //LDH A,(a8), hram
+                    emit(0x41); emit(0x0F); emit(0xB6); emit(0x86); emit32(instr.operand - 0x80); //movzx eax, byte [r14 + a8 - 0x80]
+                    emit(0x88); emit_rbx(0, at.reg8[7]);
+                    break;
+
+                case 0x2F:                                              //CPL
+                    emit(0xF6); emit_rbx(2, at.reg8[7]);                //not byte [A]
+                    emit(0x80); emit_rbx(1, at.F); emit(0x60);          //or byte [F], N | H
+                    break;
+
+                case 0x37:                                              //SCF
+                    emit(0x80); emit_rbx(4, at.F); emit(0x8F);          //and byte [F], ~(N | H | C)
+                    emit(0x80); emit_rbx(1, at.F); emit(0x10);          //or byte [F], C
+                    break;
+
+                case 0x3F:                                              //CCF
+                    emit(0x80); emit_rbx(4, at.F); emit(0x9F);          //and byte [F], ~(N | H)
+                    emit(0x80); emit_rbx(6, at.F); emit(0x10);          //xor byte [F], C
+                    break;
+
+                case 0xC9: {                                            //RET
+                    emit(0x0F); emit(0xB7); emit_rbx(1, at.SP);         //movzx ecx, word [SP]
+                    emit_resolve(false, misses);
+                    emit(0x0F); emit(0xB6); emit(0x32);                 //movzx esi, byte [rdx]
+                    emit(0x0F); emit(0xB7); emit_rbx(1, at.SP);
+                    emit(0xFF); emit(0xC1);                             //inc ecx
+                    emit(0x0F); emit(0xB7); emit(0xC9);                 //movzx ecx, cx
+                    emit_resolve(false, misses);
+                    emit(0x0F); emit(0xB6); emit(0x02);                 //movzx eax, byte [rdx]
+                    emit(0xC1); emit(0xE0); emit(0x08);                 //shl eax, 8
+                    emit(0x09); emit(0xF0);                             //or eax, esi
+                    emit(0x66); emit(0x89); emit_rbx(0, at.PC);         //mov [PC], ax
+                    emit(0x66); emit(0x83); emit_rbx(0, at.SP); emit(2);//add word [SP], 2
+
+                    int total = cycles + inline_cycles(op, true);
+                    emit_last(op, inline_cycles(op, true));
+                    emit(0x81); emit_rbx(0, at.window_cycles); emit32(total);
+                    emit(0x81); emit_rbx(0, at.window_instrs); emit32(count + 1);
+                    emit(0xE9); emit_jump(dispatch_stub);               //jmp dispatch, PC is set
+                    ended = true;
+                    break;
+                }
+
+                case 0xCD: {                                            //CALL a16
+                    uint16_t ret = next_pc;
+                    emit(0x0F); emit(0xB7); emit_rbx(1, at.SP);
+                    emit(0xFF); emit(0xC9);                             //dec ecx
+                    emit(0x0F); emit(0xB7); emit(0xC9);                 //movzx ecx, cx
+                    emit_resolve(true, misses);
+                    emit(0x48); emit(0x89); emit(0xD6);                 //mov rsi, rdx
+                    emit(0x0F); emit(0xB7); emit_rbx(1, at.SP);
+                    emit(0x83); emit(0xE9); emit(0x02);                 //sub ecx, 2
+                    emit(0x0F); emit(0xB7); emit(0xC9);                 //movzx ecx, cx
+                    emit_resolve(true, misses);
+                    emit(0xC6); emit(0x06); emit(ret >> 8);             //mov byte [rsi], high
+                    emit(0xC6); emit(0x02); emit(ret & 0xFF);           //mov byte [rdx], low
+                    emit(0x66); emit(0x83); emit_rbx(5, at.SP); emit(2);//sub word [SP], 2
+
+                    emit_exit(start, instr.operand, cycles + inline_cycles(op, true), count + 1, op, inline_cycles(op, true), links);
+                    ended = true;
+                    break;
+                }
+
+                case 0x18: case 0xC3:                                   //JR e8 / JP a16
+                {
+                    uint16_t target = (op == 0x18) ? static_cast<uint16_t>(next_pc + static_cast<int8_t>(instr.operand)) : instr.operand;
+                    emit_exit(start, target, cycles + inline_cycles(op, true), count + 1, op, inline_cycles(op, true), links);
+                    ended = true;
+                    break;
+                }
+
+                default: {                                              //JR cc / JP cc
+                    bool relative = op < 0x40;
+                    uint16_t target = relative ? static_cast<uint16_t>(next_pc + static_cast<int8_t>(instr.operand)) : instr.operand;
+                    uint8_t cc = (op >> 3) & 3; //NZ Z NC C
+                    uint8_t mask = (cc < 2) ? 0x80 : 0x10;
+                    bool jump_if_set = cc & 1;
+
+                    emit(0xF6); emit_rbx(0, at.F); emit(mask);          //test byte [F], mask
+                    size_t not_taken = emit_jcc(jump_if_set ? CC_Z : CC_NZ);
+                    emit_exit(start, target, cycles + inline_cycles(op, true), count + 1, op, inline_cycles(op, true), links);
+                    bind(not_taken);
+                    emit_exit(start, next_pc, cycles + inline_cycles(op, false), count + 1, op, inline_cycles(op, false), links);
+                    ended = true;
+                    break;
+                }
+            }
+        }
+
+        for (size_t fixup : misses) {
+            side_exits.push_back({fixup, pc, cycles, count, last_op, last_cycles});
+        }
+
+        cycles += inline_cycles(op, false);
+        max_cycles += inline_cycles(op, true);
+        count++;
+        last_op = op;
+        last_cycles = inline_cycles(op, false);
+        pc = next_pc;
+
+        if (ended) {
+            break;
+        }
+    }
+
+    if (!ended) { //ran into the block length limit or the end of the region
+        emit_exit(start, pc, cycles, count, last_op, last_cycles, links);
+    }
+
+    std::memcpy(&buffer[max_cycles_at], &max_cycles, 4);
+
+    //out of budget: the dispatcher lets the peripherals catch up and decides again
+    bind(over_budget);
+    emit(0x66); emit(0xC7); emit_rbx(0, at.PC); emit(start & 0xFF); emit(start >> 8);         //mov word [PC], start
+    emit(0xE9); emit_jump(dispatch_stub);
+
+    //side exits hand the instruction at pc to the interpreter
+    for (const exit_ref& exit : side_exits) {
+        bind(exit.fixup);
+        emit(0x66); emit(0xC7); emit_rbx(0, at.PC); emit(exit.pc & 0xFF); emit(exit.pc >> 8);  //mov word [PC], pc
+        if (exit.instrs) {
+            emit_last(exit.last_op, exit.last_cycles);
+            emit(0x81); emit_rbx(0, at.window_cycles); emit32(exit.cycles);
+            emit(0x81); emit_rbx(0, at.window_instrs); emit32(exit.instrs);
+        }
+        emit(0xE9); emit_jump(exit_stub);
+    }
+
+    //link stubs: PC = target, rsi = the jump to patch
+    for (const exit_ref& exit : links) {
+        bind(exit.fixup);
+        emit(0x66); emit(0xC7); emit_rbx(0, at.PC); emit(exit.pc & 0xFF); emit(exit.pc >> 8);
+        emit(0x48); emit(0x8D); emit(0x35);                     //lea rsi, [rip + to site]
+        emit32(static_cast<uint32_t>(exit.fixup - (buffer.size() + 4)));
+        emit(0xE9); emit_jump(link_stub);
+    }
+
+    uint8_t* entry = commit();
+    if (!entry) {
+        return false;
+    }
+
+    block->native = entry;
+    block->native_cycles = max_cycles;
+    blocks_translated++;
+    return true;
+}
+
+//translated block starting at pc, translating it now if execution keeps coming back to it
+decoded_block* jit::block_at(cpu& gb, uint16_t pc) {
+
+    decoded_block* block = cache.lookup(pc);
+
+    if (!block || block->instrs.empty()) {
+        return nullptr;
+    }
+
+    if (!block->native && !block->interpret_only && !full && ++block->exec_count >= HOT_THRESHOLD) {
+        block->interpret_only = !translate(gb, block);
+    }
+
+    return block->native ? block : nullptr;
+}
+
+//code to run for block if the cpu and the cycle budget allow it right now, else nullptr
+void* jit::enter_block(cpu& gb, decoded_block* block) {
+
+    if (!block || run_cycles >= run_budget) {
+        return nullptr;
+    }
+
+    //interrupt and ime bookkeeping is left to the interpreter, so is the cpu during oam dma
+    mmu* mem = gb.bus().memory();
+    if (gb.halted || gb.haltBug || gb.ime_schedule || gb.enable_pending || gb.disable_pending ||
+        mem->dma_cycles || (gb.IME && mem->interrupt_pending)) {
+        return nullptr;
+    }
+
+    window_budget = std::min(run_budget - run_cycles, gb.peripheral_slack());
+    if (block->native_cycles > window_budget) {
+        return nullptr;
+    }
+    return block->native;
+}
+
+//hand the cycles run since the last call to the peripherals
+void jit::settle(cpu& gb) {
+
+    if (window_instrs) {
+        gb.peripheral_catch_up(window_cycles, window_instrs);
+        run_cycles += window_cycles;
+    }
+    window_cycles = 0;
+    window_instrs = 0;
+}
+
+//called by the dispatch stub, native entry for wherever PC is now or nullptr to return
+void* jit::next(cpu* gb) {
+
+    jit& self = gb->code_jit;
+    self.settle(*gb);
+    return self.enter_block(*gb, self.block_at(*gb, gb->PC));
+}
+
+//called by a link stub: like next, and once the target is translated the jump at
+//site goes to it directly from now on
+void* jit::link(cpu* gb, uint8_t* site) {
+
+    jit& self = gb->code_jit;
+    self.settle(*gb);
+
+    decoded_block* block = self.block_at(*gb, gb->PC);
+    if (block) {
+        uint32_t rel = static_cast<uint32_t>(static_cast<uint8_t*>(block->native) - (site + 4));
+        if (self.write_code(site, &rel, 4)) {
+            self.links_patched++;
+        }
+    }
+    return self.enter_block(*gb, block);
+}
+
+//one instruction on the interpreter, the way the main loop runs it
+int jit::interpret(cpu& gb) {
+#ifdef CPU_FUSION
+    gb.cycle_budget = run_budget - run_cycles;
+#endif
+    int cycles = gb.execute();
+    gb.peripheral_tick(gb.cycles);
+    return cycles;
+}
+
+//runs translated code from PC for up to budget cycles, peripherals included, and
+//returns the cycles used (0 when PC is not the start of a hot rom block or the
+//block can't start now, the caller interprets instead). whatever the translated
+//code leaves for the interpreter runs here too, as long as it comes straight back
+//to translated code
+int jit::run(cpu& gb, int budget) {
+
+    if (cpu::bus_type::instrumented) { //translated code bypasses the bus and its counters
+        return 0;
+    }
+
+    run_budget = budget;
+    run_cycles = 0;
+
+    void* entry = enter_block(gb, block_at(gb, gb.PC));
+
+    while (entry) {
+
+        typedef void (*enter_fn)(cpu*, void*);
+        reinterpret_cast<enter_fn>(enter_stub)(&gb, entry);
+        settle(gb);
+
+        if (run_cycles >= run_budget) {
+            break;
+        }
+
+        run_cycles += interpret(gb);
+        entry = enter_block(gb, block_at(gb, gb.PC));
+    }
+
+    return run_cycles;
+}
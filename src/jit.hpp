@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "icache.hpp"
+#include "bus.hpp"
+
+//optional x86-64 backend (make JIT=1).
+//rom blocks the interpreter keeps entering get translated into native code. loads,
+//stores, 8 bit alu ops, inc / dec and jr / jp / call / ret run inline on the guest
+//registers in the cpu object, rotates, cb ops and a few others call their opcode
+//handler. memory goes through the mmu page table and hram; vram and anything the
+//page table can't serve (io, mbc registers) leaves the block and the interpreter
+//runs that instruction.
+//
+//the peripherals aren't ticked per instruction. before a block starts, the jit asks
+//how far they can run before anything the cpu could see changes (an interrupt it
+//would take, timer overflow) and the block only runs if its longest path fits
+//in that. they catch up on everything in one go once control is back in c++.
+//jumps with a known target in the same rom region get patched to go straight to the
+//next block. only rom is translated, code in ram always runs on the interpreter.
+class jit {
+    private:
+
+        icache& cache;
+
+        static const size_t CODE_SIZE = 4 * 1024 * 1024;
+        static const uint32_t HOT_THRESHOLD = 32;
+
+        uint8_t* code = nullptr;
+        size_t used = 0;
+        bool full = false;
+
+        uint8_t* enter_stub = nullptr;      //(cpu*, entry) -> runs until the generated code gives up
+        uint8_t* exit_stub = nullptr;       //back to run()
+        uint8_t* dispatch_stub = nullptr;   //PC is set, carry on with the block there or return
+        uint8_t* link_stub = nullptr;       //same, and patch the jump at rsi to go there directly
+
+        std::vector<uint8_t> buffer;
+
+        //where the generated code finds things, as offsets from the cpu in rbx
+        struct cpu_layout {
+            int32_t reg8[8];    //B C D E H L - A, by the register field of the opcode
+            int32_t F, BC, DE, HL, SP, PC;
+            int32_t opcode, cycles, n8, lazy_op;
+            int32_t window_cycles, window_instrs, window_budget;
+        } at;
+
+        //a jump out of the block, filled in once the code it goes to is emitted
+        struct exit_ref {
+            size_t fixup;       //rel32 to patch
+            uint16_t pc;        //where the guest continues
+            int cycles;         //cycles and instructions run in the block up to there
+            int instrs;
+            uint8_t last_op;    //the last of those, see emit_last
+            int last_cycles;
+        };
+
+        int run_budget = 0;     //cycles run() may use
+        int run_cycles = 0;     //of those, already handed to the peripherals
+
+        void emit(uint8_t byte) { buffer.push_back(byte); }
+        void emit32(uint32_t value);
+        void emit64(uint64_t value);
+        void emit_rbx(uint8_t reg, int32_t offset);
+        void emit_call(const void* target);
+        void emit_jump(const uint8_t* target);
+        size_t emit_jcc(uint8_t condition);
+        size_t emit_jmp();
+        void bind(size_t fixup);
+
+        void emit_resolve(bool write, std::vector<size_t>& misses);
+        void emit_store_flags(uint8_t keep);
+        void emit_lahf_flags(uint8_t set, uint8_t keep, bool carry);
+        void emit_logic_flags(uint8_t set);
+        void emit_last(uint8_t op, int cycles);
+        void emit_exit(uint16_t start, uint16_t target, int cycles, int instrs, uint8_t last_op, int last_cycles, std::vector<exit_ref>& links);
+
+        bool write_code(uint8_t* to, const void* from, size_t size);
+        uint8_t* commit();
+        bool emit_stubs(cpu& gb);
+        bool translate(cpu& gb, decoded_block* block);
+
+        decoded_block* block_at(cpu& gb, uint16_t pc);
+        void* enter_block(cpu& gb, decoded_block* block);
+        void settle(cpu& gb);
+        int interpret(cpu& gb);
+
+        static void* next(cpu* gb);
+        static void* link(cpu* gb, uint8_t* site);
+
+    public:
+
+        jit(icache& shared_cache) : cache(shared_cache){};
+        ~jit();
+
+        //run since the peripherals last caught up, and how far they may get
+        int window_cycles = 0;
+        int window_instrs = 0;
+        int window_budget = 0;
+
+        uint64_t blocks_translated = 0;
+        uint64_t links_patched = 0;
+
+        int run(cpu& gb, int budget);
+        void reset();
+};
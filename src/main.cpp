@@ -4,6 +4,8 @@
 #include "external/raylib.h"
 #include <cstdlib>
 #include <iomanip>
+#include <algorithm>
+#include <vector>
 
 #include "colors.hpp"
 #include "cpu.hpp"
@@ -35,12 +37,21 @@ uint8_t g_polled_directions = 0x0F;
 bool dpad_enable = false;
 bool buttons_enable = false;
 
+//time skipped by the idle loop detector, against everything emulated
+uint64_t idle_cycles_skipped = 0;
+uint64_t cycles_emulated = 0;
+
 //declarations
 void render_screen(ppu& graphics);
 void draw_debug_overlay(cpu& gb, mmu& mem, Font customfont);
 void draw_tilemap_viewer(cpu& gb, ppu& graphics, int startX, int startY);
 void handle_inputs(cpu& gb, mmu& mem, ppu& graphics);
 void tick_peripherals(mmu& mem, ppu& graphics, int cycles);
+int peripheral_slack(mmu& mem, ppu& graphics, bool interrupts_enabled);
+void catch_up_peripherals(mmu& mem, ppu& graphics, int cycles, int instructions);
+int skip_halt(cpu& gb, mmu& mem, ppu& graphics, int cycle_budget);
+int skip_idle_loop(cpu& gb, mmu& mem, ppu& graphics, int cycle_budget);
+void print_fusion_stats(cpu& gb);
 void render_all(cpu& gb, mmu& mem, ppu& graphics, Font customfont);
 
 
@@ -51,12 +62,30 @@ int main(int argc, char *argv[]){
     ppu graphics(mem);
     mem.connect_ppu(&graphics);
     cpu gb(mem);
+#if defined(CPU_JIT) || defined(CPU_FUSION)
+    gb.peripheral_tick = [&](int cycles) { tick_peripherals(mem, graphics, cycles); };
+#endif
+#ifdef CPU_JIT
+    gb.peripheral_slack = [&]() { return peripheral_slack(mem, graphics, gb.IME); };
+    gb.peripheral_catch_up = [&](int cycles, int instructions) { catch_up_peripherals(mem, graphics, cycles, instructions); };
+#endif
 
     if (argc < 2) {
-        std::cout << "USAGE: ./gb [filename].gb \n";
+        std::cout << "USAGE: ./gb [filename].gb [--accurate-dma] [--fast-boot]\n";
         exit( 1 );
     }
 
+    for (int i = 2; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--accurate-dma") {
+            mem.accurate_dma = true; //oam fills byte by byte over every transfer
+        } else if (option == "--fast-boot") {
+            gb.fast_boot = true; //straight to the cartridge at 0x0100
+        } else {
+            std::cout << "Unknown option: " << option << "\n";
+        }
+    }
+
     SetConfigFlags(FLAG_VSYNC_HINT | FLAG_MSAA_4X_HINT);
     InitWindow(screenWidth, screenHeight, "GB");
 
@@ -78,10 +107,31 @@ int main(int argc, char *argv[]){
         if (run) {
             int cycles_this_frame = 0;
             while (cycles_this_frame < TARGET_CYCLES_PER_FRAME) {
+                if (gb.halted) {
+                    cycles_this_frame += skip_halt(gb, mem, graphics, TARGET_CYCLES_PER_FRAME - cycles_this_frame);
+                }
+#ifdef CPU_JIT
+                if (gb.code_cache.starts_block(gb.PC)) { //translated code only ever starts a block
+                    int jit_cycles = gb.code_jit.run(gb, TARGET_CYCLES_PER_FRAME - cycles_this_frame);
+                    if (jit_cycles) {
+                        cycles_this_frame += jit_cycles;
+                        continue;
+                    }
+                }
+#endif
+                uint16_t last_pc = gb.PC;
+#ifdef CPU_FUSION
+                gb.cycle_budget = TARGET_CYCLES_PER_FRAME - cycles_this_frame;
+#endif
                 int cycles_executed = gb.execute();
                 cycles_this_frame += cycles_executed;
-                tick_peripherals(mem, graphics, cycles_executed);
+                tick_peripherals(mem, graphics, gb.cycles); //a fused idiom already ticked all but its last instruction
+
+                if (gb.PC <= last_pc) { //jumped back, might be spinning on an io register
+                    cycles_this_frame += skip_idle_loop(gb, mem, graphics, TARGET_CYCLES_PER_FRAME - cycles_this_frame);
+                }
             }
+            cycles_emulated += cycles_this_frame;
         }
 
         render_all(gb, mem, graphics, customfont);
@@ -90,6 +140,15 @@ int main(int argc, char *argv[]){
 
 
 
+#ifdef CPU_FUSION
+    print_fusion_stats(gb);
+#endif
+
+    if (cycles_emulated) {
+        std::cout << "\n" << playerRom << ": idle loops skipped " << std::dec << idle_cycles_skipped << " of "
+                  << cycles_emulated << " cycles (" << 100.0 * idle_cycles_skipped / cycles_emulated << "%)\n";
+    }
+
     CloseWindow();
 
     return 1;
@@ -114,6 +173,8 @@ void render_screen(ppu& graphics) {
 }
 
 void draw_debug_overlay(cpu& gb, mmu& mem, Font customfont) {
+
+    gb.flush_flags(); //AF is only up to date once pending lazy flags are resolved
     
     DrawTextEx(customfont, TextFormat("AF: %04x, BC: %04x", gb.AF, gb.BC), {debugX, 0}, 32.0, 2.0, GREEN);
     DrawTextEx(customfont, TextFormat("DE: %04x, HL: %04x", gb.DE, gb.HL), {debugX, 30}, 32.0, 2.0, GREEN);
@@ -126,6 +187,17 @@ void draw_debug_overlay(cpu& gb, mmu& mem, Font customfont) {
     DrawTextEx(customfont, TextFormat("SCX: %02x, SCY: %02x", mem.rd(0xFF43), mem.rd(0xFF42)), {debugX,240}, 32.0, 2.0, GREEN);
     DrawTextEx(customfont, TextFormat("IF: %02x, KEYPAD: %02x", mem.interrupts, mem.rd(0xFF00)), {debugX,270}, 32.0, 2.0, GREEN);
 
+    if (cpu::bus_type::instrumented) { //decoder statistics are compiled out on the production bus
+        float reads_saved = gb.instructions_executed ? (float)gb.operand_reads_saved / gb.instructions_executed : 0.0f;
+        DrawTextEx(customfont, TextFormat("READS SAVED: %.2f/INSTR", reads_saved), {debugX,300}, 32.0, 2.0, GREEN);
+
+        float cache_hits = gb.instructions_executed ? 100.0f * gb.code_cache.hits / gb.instructions_executed : 0.0f;
+        DrawTextEx(customfont, TextFormat("ICACHE: %.1f%% HIT", cache_hits), {debugX,330}, 32.0, 2.0, GREEN);
+    }
+
+    float idle_skipped = cycles_emulated ? 100.0f * idle_cycles_skipped / cycles_emulated : 0.0f;
+    DrawTextEx(customfont, TextFormat("IDLE SKIPPED: %.1f%%", idle_skipped), {debugX,360}, 32.0, 2.0, GREEN);
+
 }
 
 void draw_tilemap_viewer(cpu& gb, ppu& graphics, int startX, int startY) {
@@ -262,38 +334,36 @@ void tick_peripherals(mmu& mem, ppu& graphics, int cycles) {
     int tma_reload_value;
     bool tma_reload_scheduled = false;
 
-    uint8_t TAC = mem.rd(0xFF07);
+    uint8_t TAC = mem.TAC;
 
 
     if (tma_reload_scheduled) {
         tma_reload_cycles--;
         
         if (tma_reload_cycles <= 0) {
-            mem.ld(tma_reload_value, 0xFF05);
+            mem.TIMA = tma_reload_value;
             tma_reload_scheduled = false;
         }
     }
 
     if (TAC & 0x4) {
 
-        uint8_t TIMA = mem.rd(0xFF05);
+        uint8_t TIMA = mem.TIMA;
 
         if ((TIMA) == 0xFF) { //TIMA overflow
 
-            mem.ld(0, 0xFF05); //wrap to 0
+            mem.TIMA = 0; //wrap to 0
 
-            uint8_t TMA = mem.rd(0xFF06);
+            uint8_t TMA = mem.TMA;
 
-            uint8_t interruptFlag = mem.rd(0xFF0F);
-            interruptFlag |= 0x4;
-            mem.ld(interruptFlag, 0xFF0F);
+            mem.request_interrupt(0x4);
 
             tma_reload_scheduled = true;
-            tma_reload_value = mem.rd(0xFF06); 
+            tma_reload_value = mem.TMA; 
             tma_reload_cycles = 4; 
 
         } else{
-            mem.ld(TIMA + 1, 0xFF05);
+            mem.TIMA = TIMA + 1;
         }
     }
 
@@ -302,11 +372,13 @@ void tick_peripherals(mmu& mem, ppu& graphics, int cycles) {
     mem.div++;
 
 
-    //execute ppu for N cycles per cpu cycle only if LCD is on!
-    if (mem.rd(0xFF40) & 0x80) {
-        for (int i = 0; i < cycles; i++) {
-            graphics.tick();
-        }
+    mem.tick_dma(cycles);
+    mem.serial.tick(cycles);
+
+    //execute ppu for N cycles per cpu cycle only if LCD is on! straight to the next
+    //mode switch or line, nothing happens on the cycles in between
+    if (graphics.LCDC & 0x80) {
+        graphics.advance(cycles);
     }
     else {
         graphics.set_ppu_mode(graphics.h_blank);
@@ -317,6 +389,221 @@ void tick_peripherals(mmu& mem, ppu& graphics, int cycles) {
 
 }
 
+//cycles the peripherals can run ahead of the cpu without anything it could see
+//changing: no TIMA overflow, serial interrupt or ppu interrupt the cpu would take on
+//the way. native code can't reach io or vram, so ppu mode and line switches alone
+//don't count. 0 while an oam dma is running
+int peripheral_slack(mmu& mem, ppu& graphics, bool interrupts_enabled) {
+
+    if (mem.dma_cycles) {
+        return 0;
+    }
+
+    int slack = 0x7FFFFFFF;
+
+    uint8_t TAC = mem.TAC;
+    if (TAC & 0x4) {
+        slack = 4 * (0xFF - mem.TIMA); //TIMA counts instructions, none is under 4 cycles
+    }
+    if ((graphics.LCDC & 0x80) && interrupts_enabled && (mem.rd(0xFFFF) & 0x3)) {
+        slack = std::min(slack, graphics.cycles_until_interrupt() - 1); //the rest the cpu only sees through io and vram
+    }
+    int serial_cycles = mem.serial.cycles_until_interrupt();
+    if (serial_cycles) {
+        slack = std::min(slack, serial_cycles - 1);
+    }
+
+    return slack;
+}
+
+//the same as instructions calls to tick_peripherals worth cycles in all, for a
+//stretch that peripheral_slack allowed
+void catch_up_peripherals(mmu& mem, ppu& graphics, int cycles, int instructions) {
+
+    uint8_t TAC = mem.TAC;
+    if (TAC & 0x4) {
+        mem.TIMA += instructions;
+    }
+    mem.div += instructions;
+
+    mem.serial.tick(cycles);
+
+    if (graphics.LCDC & 0x80) {
+        graphics.advance(cycles);
+    } else { //what tick_peripherals does with the lcd off, once is enough
+        graphics.set_ppu_mode(graphics.h_blank);
+        uint8_t temp = mem.rd(0xFF40);
+        temp &= 0x11111100;
+        mem.ld(temp, 0xFF40);
+    }
+}
+
+//while halted every execute() is 4 cycles of nothing followed by tick_peripherals.
+//jump over all of those up to the one where something raises IF (timer overflow,
+//LY == LYC or vblank) or the frame ends, that last step still goes through execute()
+int skip_halt(cpu& gb, mmu& mem, ppu& graphics, int cycle_budget) {
+
+    const int HALT_STEP = 4;
+
+    if (gb.ime_schedule || gb.enable_pending || gb.disable_pending || mem.dma_cycles) {
+        return 0;
+    }
+    if (mem.interrupt_pending) { //about to wake up
+        return 0;
+    }
+
+    int steps = (cycle_budget + HALT_STEP - 1) / HALT_STEP;
+
+    uint8_t TAC = mem.TAC;
+    if (TAC & 0x4) {
+        int timer_steps = 0xFF - mem.TIMA + 1; //step where TIMA overflows
+        steps = std::min(steps, timer_steps);
+    }
+
+    bool lcd_on = mem.rd(0xFF40) & 0x80;
+    if (lcd_on) {
+        int ppu_steps = (graphics.cycles_until_interrupt() + HALT_STEP - 1) / HALT_STEP;
+        steps = std::min(steps, ppu_steps);
+    }
+
+    int serial_cycles = mem.serial.cycles_until_interrupt();
+    if (serial_cycles) {
+        steps = std::min(steps, (serial_cycles + HALT_STEP - 1) / HALT_STEP);
+    }
+
+    int skipped = steps - 1;
+    if (skipped <= 0) {
+        return 0;
+    }
+
+    if (TAC & 0x4) {
+        mem.TIMA += skipped;
+    }
+    mem.div += skipped;
+
+    if (lcd_on) {
+        graphics.advance(skipped * HALT_STEP);
+    }
+    //with the lcd off tick_peripherals only rewrites STAT and LCDC, already done by the last step
+
+    mem.serial.tick(skipped * HALT_STEP);
+
+    return skipped * HALT_STEP;
+}
+
+//cycles a single pass of a poll loop takes, same values as opcodes.inc
+static int poll_instr_cycles(uint8_t opcode) {
+    switch (opcode) {
+        case 0xF0: return 12; //LDH A,(a8)
+        case 0xFA: return 16; //LD A,(a16)
+        case 0xE6: return 8;  //AND n8
+        case 0xFE: return 8;  //CP n8
+        default:   return 12; //JR NZ/Z, taken
+    }
+}
+
+//PC is at the start of a block that only reads LY, STAT, IF or DIV and branches back
+//to itself (see icache poll_address). every pass leaves the cpu in the same state
+//as long as the register reads the same, so whole passes can be skipped up to the
+//one where the value changes, something raises IF or the frame ends
+int skip_idle_loop(cpu& gb, mmu& mem, ppu& graphics, int cycle_budget) {
+
+    if (gb.halted || gb.ime_schedule || gb.enable_pending || gb.disable_pending || mem.dma_cycles) {
+        return 0;
+    }
+    if (gb.IME && mem.interrupt_pending) { //about to take an interrupt
+        return 0;
+    }
+
+    decoded_block* block = gb.code_cache.find(gb.PC);
+    if (!block || !block->poll_register) {
+        return 0;
+    }
+
+    //run the loop condition on the current value, only a loop that keeps spinning is skipped
+    uint8_t A = mem.rd(block->poll_register);
+    bool zero = gb.get_ZF();
+    int pass_cycles = 0;
+
+    for (const decoded_instr& instr : block->instrs) {
+        if (instr.opcode == 0xE6) {
+            A &= instr.operand;
+            zero = (A == 0);
+        } else if (instr.opcode == 0xFE) {
+            zero = (A == instr.operand);
+        }
+        pass_cycles += poll_instr_cycles(instr.opcode);
+    }
+
+    bool taken = (block->instrs.back().opcode == 0x20) ? !zero : zero;
+    if (!taken) {
+        return 0;
+    }
+
+    //tick_peripherals runs once per instruction, the timer and DIV count those calls
+    int pass_steps = block->instrs.size();
+    int max_cycles = cycle_budget - 1;
+    int max_steps = 0x7FFFFFFF;
+
+    uint8_t TAC = mem.TAC;
+    if (TAC & 0x4) {
+        max_steps = std::min(max_steps, 0xFF - mem.TIMA); //stop short of the TIMA overflow
+    }
+    if (block->poll_register == 0xFF04) {
+        max_steps = std::min(max_steps, 0xFF - (mem.div & 0xFF));
+    }
+
+    bool lcd_on = mem.rd(0xFF40) & 0x80;
+    if (lcd_on) {
+        max_cycles = std::min(max_cycles, graphics.cycles_until_interrupt() - 1);
+
+        if (block->poll_register == 0xFF44) {
+            max_cycles = std::min(max_cycles, 456 - graphics.clocks - 1);
+        } else if (block->poll_register == 0xFF41) {
+            max_cycles = std::min(max_cycles, graphics.next_event_cycle() - 1);
+        }
+    }
+
+    int serial_cycles = mem.serial.cycles_until_interrupt();
+    if (serial_cycles) {
+        max_cycles = std::min(max_cycles, serial_cycles - 1);
+    }
+
+    int passes = std::min(max_cycles / pass_cycles, max_steps / pass_steps);
+    if (passes <= 0) {
+        return 0;
+    }
+
+    if (TAC & 0x4) {
+        mem.TIMA += passes * pass_steps;
+    }
+    mem.div += passes * pass_steps;
+
+    if (lcd_on) {
+        graphics.advance(passes * pass_cycles);
+    }
+    mem.serial.tick(passes * pass_cycles);
+
+    idle_cycles_skipped += passes * pass_cycles;
+    return passes * pass_cycles;
+}
+
+//how often each idiom from fusions.inc ran, most frequent first
+void print_fusion_stats(cpu& gb) {
+#ifdef CPU_FUSION
+    std::vector<int> order;
+    for (int id = 1; id < FUSION_COUNT; id++) {
+        order.push_back(id);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return gb.fusion_counts[a] > gb.fusion_counts[b]; });
+
+    std::cout << "\nfused idioms:\n";
+    for (int id : order) {
+        std::cout << std::setw(16) << std::left << fusion_patterns[id].name << std::dec << gb.fusion_counts[id] << "\n";
+    }
+#endif
+}
+
 void render_all(cpu& gb, mmu& mem, ppu& graphics, Font customfont) {
     BeginDrawing();
     ClearBackground({13, 12, 36, 255});
@@ -0,0 +1,200 @@
+#include "mapper.hpp"
+
+std::unique_ptr<mapper> make_mapper(uint8_t type, uint16_t rom_banks) {
+
+    switch (type) {
+        case 0x00:
+            return std::unique_ptr<mapper>(new rom_only(rom_banks, false));
+        case 0x08: case 0x09:
+            return std::unique_ptr<mapper>(new rom_only(rom_banks, true));
+        case 0x05: case 0x06:
+            return std::unique_ptr<mapper>(new mbc2(rom_banks));
+        case 0x0F: case 0x10:
+            return std::unique_ptr<mapper>(new mbc3(rom_banks, true));
+        case 0x11: case 0x12: case 0x13:
+            return std::unique_ptr<mapper>(new mbc3(rom_banks, false));
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            return std::unique_ptr<mapper>(new mbc5(rom_banks));
+        default: //0x01 - 0x03, and anything unsupported gets the most common controller
+            return std::unique_ptr<mapper>(new mbc1(rom_banks));
+    }
+}
+
+size_t ram_size(uint8_t type, uint8_t ram_size_code) {
+
+    static const size_t sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+
+    size_t size = (ram_size_code < 6) ? sizes[ram_size_code] : 0;
+    if (type == 0x05 || type == 0x06) {
+        size = 0x200; //mbc2 has its ram built in
+    }
+    return (size < 0x2000) ? 0x2000 : size;
+}
+
+bool battery_backed(uint8_t type) {
+    switch (type) {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F:
+        case 0x10: case 0x13: case 0x1B: case 0x1E:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+void mbc1::write(uint8_t data, uint16_t address) {
+
+    if (address <= 0x1FFF) {
+        ram_enable = (data & 0x0F) == 0x0A;
+    }
+    else if (address <= 0x3FFF) {
+        bank1 = data & 0b00011111;
+        if (bank1 == 0) {
+            bank1 = 1; //0x00, 0x20, 0x40 and 0x60 can't be selected at 0x4000
+        }
+    }
+    else if (address <= 0x5FFF) {
+        bank2 = data & 0b00000011;
+    }
+    else {
+        mode = data & 0x01;
+    }
+}
+
+uint16_t mbc1::low_rom_bank() {
+    return mode ? ((bank2 << 5) & rom_mask) : 0;
+}
+
+uint16_t mbc1::high_rom_bank() {
+    return ((bank2 << 5) | bank1) & rom_mask;
+}
+
+int mbc1::ram_bank() {
+    if (!ram_enable) {
+        return -1;
+    }
+    return mode ? bank2 : 0;
+}
+
+
+void mbc2::write(uint8_t data, uint16_t address) {
+
+    if (address > 0x3FFF) {
+        return;
+    }
+
+    if (address & 0x0100) { //bit 8 of the address picks the register
+        rom_bank = data & 0x0F;
+        if (rom_bank == 0) {
+            rom_bank = 1;
+        }
+    } else {
+        ram_enable = (data & 0x0F) == 0x0A;
+    }
+}
+
+uint8_t mbc2::read_ram(save_ram& eram, uint16_t address) {
+    if (!ram_enable) {
+        return 0xFF;
+    }
+    return eram.data()[address & 0x01FF] | 0xF0; //only the low nibble exists
+}
+
+void mbc2::write_ram(save_ram& eram, uint8_t data, uint16_t address) {
+    if (ram_enable) {
+        eram.data()[address & 0x01FF] = data & 0x0F;
+        eram.mark_dirty(address & 0x01FF);
+    }
+}
+
+
+void mbc3::write(uint8_t data, uint16_t address) {
+
+    if (address <= 0x1FFF) {
+        ram_enable = (data & 0x0F) == 0x0A;
+    }
+    else if (address <= 0x3FFF) {
+        rom_bank = data & 0b01111111;
+        if (rom_bank == 0) {
+            rom_bank = 1;
+        }
+    }
+    else if (address <= 0x5FFF) {
+        ram_select = data;
+    }
+    else {
+        if (has_rtc && latch_write == 0x00 && data == 0x01) {
+            update_rtc();
+            for (int i = 0; i < 5; i++) {
+                latched[i] = rtc[i];
+            }
+        }
+        latch_write = data;
+    }
+}
+
+int mbc3::ram_bank() {
+    if (!ram_enable || ram_select > 0x03) {
+        return -1; //clock registers go through read_ram/write_ram
+    }
+    return ram_select;
+}
+
+uint8_t mbc3::read_ram(save_ram&, uint16_t) {
+    if (!ram_enable || !has_rtc || ram_select < 0x08 || ram_select > 0x0C) {
+        return 0xFF;
+    }
+    return latched[ram_select - 0x08];
+}
+
+void mbc3::write_ram(save_ram&, uint8_t data, uint16_t) {
+    if (!ram_enable || !has_rtc || ram_select < 0x08 || ram_select > 0x0C) {
+        return;
+    }
+    update_rtc();
+    rtc[ram_select - 0x08] = data;
+}
+
+//moves the clock on by the host time since the last access, unless it is halted
+void mbc3::update_rtc() {
+
+    std::time_t now = std::time(nullptr);
+    uint64_t elapsed = (now > last_update) ? now - last_update : 0;
+    last_update = now;
+
+    if (rtc[4] & 0x40 || elapsed == 0) {
+        return;
+    }
+
+    uint64_t seconds = rtc[0] + elapsed;
+    uint64_t minutes = rtc[1] + seconds / 60;
+    uint64_t hours   = rtc[2] + minutes / 60;
+    uint64_t days    = (((rtc[4] & 0x01) << 8) | rtc[3]) + hours / 24;
+
+    rtc[0] = seconds % 60;
+    rtc[1] = minutes % 60;
+    rtc[2] = hours % 24;
+
+    if (days > 0x1FF) {
+        rtc[4] |= 0x80; //day counter overflowed, stays set until the game clears it
+    }
+    rtc[3] = days & 0xFF;
+    rtc[4] = (rtc[4] & 0xFE) | ((days >> 8) & 0x01);
+}
+
+
+void mbc5::write(uint8_t data, uint16_t address) {
+
+    if (address <= 0x1FFF) {
+        ram_enable = (data & 0x0F) == 0x0A;
+    }
+    else if (address <= 0x2FFF) {
+        rom_bank = (rom_bank & 0x100) | data;
+    }
+    else if (address <= 0x3FFF) {
+        rom_bank = (rom_bank & 0xFF) | ((data & 0x01) << 8);
+    }
+    else if (address <= 0x5FFF) {
+        ram_bank_number = data & 0x0F;
+    }
+}
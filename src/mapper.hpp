@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <memory>
+
+#include "save.hpp"
+
+//memory bank controllers. a mapper only sees writes to 0x0000 - 0x7FFF and the eram
+//accesses the page table can't serve, after every register write the mmu asks it
+//which banks are selected and maps them (see mmu::map_rom and mmu::map_eram), so
+//reads and writes never go through here
+class mapper {
+    public:
+
+        mapper(uint16_t rom_banks) : rom_mask(rom_banks - 1){};
+        virtual ~mapper() {}
+
+        virtual void write(uint8_t data, uint16_t address) = 0;
+
+        //banking registers back to power on. what the cartridge keeps running on its
+        //own (the mbc3 clock and its latch) is left alone
+        virtual void reset() {}
+
+        virtual uint16_t low_rom_bank() { return 0; }  //bank at 0x0000 - 0x3FFF
+        virtual uint16_t high_rom_bank() { return 1; } //bank at 0x4000 - 0x7FFF
+
+        //eram bank mapped straight into 0xA000 - 0xBFFF, -1 while disabled or not plain ram
+        virtual int ram_bank() { return -1; }
+
+        //eram accesses that aren't plain ram (mbc2 nibbles, mbc3 clock registers)
+        virtual uint8_t read_ram(save_ram&, uint16_t) { return 0xFF; }
+        virtual void write_ram(save_ram&, uint8_t, uint16_t) {}
+
+    protected:
+
+        uint16_t rom_mask; //rom sizes are powers of two, bank numbers wrap around
+};
+
+//0x147 = 0x00, 0x08, 0x09
+class rom_only : public mapper {
+    public:
+
+        rom_only(uint16_t rom_banks, bool has_ram) : mapper(rom_banks), has_ram(has_ram){};
+
+        void write(uint8_t, uint16_t) override {}
+        int ram_bank() override { return has_ram ? 0 : -1; }
+
+    private:
+
+        bool has_ram;
+};
+
+//0x147 = 0x01 - 0x03
+class mbc1 : public mapper {
+    public:
+
+        using mapper::mapper;
+
+        void write(uint8_t data, uint16_t address) override;
+        void reset() override { ram_enable = false; bank1 = 1; bank2 = 0; mode = 0; }
+        uint16_t low_rom_bank() override;
+        uint16_t high_rom_bank() override;
+        int ram_bank() override;
+
+    private:
+
+        bool ram_enable = false;
+        uint8_t bank1 = 1; //0x2000 - 0x3FFF, low 5 bits of the rom bank
+        uint8_t bank2 = 0; //0x4000 - 0x5FFF, ram bank or upper 2 bits of the rom bank
+        uint8_t mode = 0;  //0x6000 - 0x7FFF, 1 lets bank2 switch ram and 0x0000 - 0x3FFF
+};
+
+//0x147 = 0x05, 0x06. 512 half bytes of ram built in, echoed across 0xA000 - 0xBFFF
+class mbc2 : public mapper {
+    public:
+
+        using mapper::mapper;
+
+        void write(uint8_t data, uint16_t address) override;
+        void reset() override { ram_enable = false; rom_bank = 1; }
+        uint16_t high_rom_bank() override { return rom_bank & rom_mask; }
+        uint8_t read_ram(save_ram& eram, uint16_t address) override;
+        void write_ram(save_ram& eram, uint8_t data, uint16_t address) override;
+
+    private:
+
+        bool ram_enable = false;
+        uint8_t rom_bank = 1;
+};
+
+//0x147 = 0x0F - 0x13, 0x0F and 0x10 have the real time clock
+class mbc3 : public mapper {
+    public:
+
+        mbc3(uint16_t rom_banks, bool has_rtc) : mapper(rom_banks), has_rtc(has_rtc){};
+
+        void write(uint8_t data, uint16_t address) override;
+        void reset() override { ram_enable = false; rom_bank = 1; ram_select = 0; }
+        uint16_t high_rom_bank() override { return rom_bank & rom_mask; }
+        int ram_bank() override;
+        uint8_t read_ram(save_ram& eram, uint16_t address) override;
+        void write_ram(save_ram& eram, uint8_t data, uint16_t address) override;
+
+    private:
+
+        bool ram_enable = false;
+        uint8_t rom_bank = 1;
+        uint8_t ram_select = 0; //0x00 - 0x03 ram bank, 0x08 - 0x0C clock register
+
+        //clock registers: seconds, minutes, hours, day low, day high (bit 0 day bit 8, bit 6 halt, bit 7 day carry)
+        bool has_rtc;
+        uint8_t rtc[5] = {0};
+        uint8_t latched[5] = {0};
+        uint8_t latch_write = 0xFF; //0x00 then 0x01 copies rtc into latched
+        std::time_t last_update = std::time(nullptr);
+
+        void update_rtc();
+};
+
+//0x147 = 0x19 - 0x1E
+class mbc5 : public mapper {
+    public:
+
+        using mapper::mapper;
+
+        void write(uint8_t data, uint16_t address) override;
+        void reset() override { ram_enable = false; rom_bank = 1; ram_bank_number = 0; }
+        uint16_t high_rom_bank() override { return rom_bank & rom_mask; }
+        int ram_bank() override { return ram_enable ? ram_bank_number : -1; }
+
+    private:
+
+        bool ram_enable = false;
+        uint16_t rom_bank = 1; //9 bits, bank 0 can be mapped at 0x4000
+        uint8_t ram_bank_number = 0;
+};
+
+//picks the controller from the cartridge type header byte (0x147), bank numbers wrap at rom_banks
+std::unique_ptr<mapper> make_mapper(uint8_t type, uint16_t rom_banks);
+
+//cartridge ram size from the type (0x147) and ram size (0x149) header bytes, rounded up
+//to one 8kb bank since that is the window it is mapped through
+size_t ram_size(uint8_t type, uint8_t ram_size_code);
+
+//whether the cartridge keeps its ram (and clock) with a battery
+bool battery_backed(uint8_t type);
@@ -1,46 +1,300 @@
 #include "mmu.hpp"
 #include "ppu.hpp"
 
+#include <cstring>
+
 extern uint8_t g_polled_actions;
 extern uint8_t g_polled_directions;
 
+//bits of each io register that don't exist on the dmg and read back as 1,
+//0xFF for addresses with no register behind them
+static const uint8_t io_unused_bits[0x80] = {
+    0xC0, 0x00, 0x7E, 0xFF, 0x00, 0x00, 0x00, 0xF8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xE0, //joypad, serial, timer, IF
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF, //sound
+    0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, //wave ram
+    0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, //lcd
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, //boot rom
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+//io registers the mmu looks after itself, the serial port adds its own here and the ppu in connect_ppu
+mmu::mmu() {
+
+    for (int i = 0; i < 0x80; i++) {
+        io[i].unused = io_unused_bits[i];
+    }
+
+    serial.connect_io();
+
+    hook_io(0xFF00, [this]() { //joypad, the selected half of the buttons (0 = pressed)
+
+        uint8_t state = IO[0];
+        uint8_t output = state | 0x0F;
+
+        if (!(state & 0x10)) { 
+            output &= g_polled_directions;
+        }
+        if (!(state & 0x20)) { 
+            output &= g_polled_actions; 
+        }
+        return output;
+
+    }, [this](uint8_t data) {
+        IO[0] = (data & 0x30) | (IO[0] & 0x0F); //only the select bits are writable
+    });
+
+    hook_io(0xFF04, [this]() { return (div & 0xFF00) >> 8; }, [this](uint8_t) { div = 0; });
+
+    hook_io(0xFF05, [this]() { return TIMA; }, [this](uint8_t data) { TIMA = data; });
+    hook_io(0xFF06, [this]() { return TMA; }, [this](uint8_t data) { TMA = data; });
+    hook_io(0xFF07, [this]() { return TAC; }, [this](uint8_t data) { TAC = data & 0x07; });
+
+    hook_io(0xFF0F, nullptr, [this](uint8_t data) { //interrupt flag
+        IO[0x0F] = data & 0x1F;
+        update_interrupt_pending();
+    });
+
+    hook_io(0xFF46, nullptr, [this](uint8_t data) { //oam dma
+        IO[0x46] = data;
+        start_dma(data);
+    });
+
+    hook_io(0xFF50, nullptr, [this](uint8_t) {
+        bootRomEnabled = false; 
+        map_rom();
+        std::cout << "Boot Rom Disabled!\n";
+    });
+}
+
+void mmu::hook_io(uint16_t address, std::function<uint8_t()> read, std::function<void(uint8_t)> write) {
+    io[address - 0xFF00].read = std::move(read);
+    io[address - 0xFF00].write = std::move(write);
+}
+
 void mmu::connect_ppu(ppu* ppu_ptr) {
     this->graphics = ppu_ptr;
+    graphics->connect_io();
+    remap();
 }
 
+//new cartridge, pick its controller from the header and map its banks
+void mmu::insert_cartridge(std::shared_ptr<const rom_image> rom) {
 
-void mmu::ld(uint8_t data, uint16_t address) {
-    if (address <= 0xFF) {
-        return; //bootrom is read only
+    cart.rom = std::move(rom);
+    cart.romBank = cart.rom->data();
+
+    dma_cycles = 0; //power on, nothing in flight
+
+    uint8_t type = cart.romBank[0x147];
+    size_t size = ram_size(type, cart.romBank[0x149]);
+
+    cart.ram.reset(); //writes back the old save first, the new one may be the same file
+
+    if (battery_backed(type) && !cart.rom->path().empty()) {
+        std::string path = cart.rom->path();
+        size_t dot = path.find_last_of('.');
+        size_t slash = path.find_last_of('/');
+        if (dot != std::string::npos && (slash == std::string::npos || slash < dot)) {
+            path.erase(dot); //game.gb -> game.sav
+        }
+        cart.ram = save_ram::open(path + ".sav", size);
+    } else {
+        cart.ram = save_ram::in_memory(size);
     }
+    cart.ERAM = cart.ram->data();
+
+    mbc = make_mapper(type, cart.rom->banks());
+    remap();
+}
+
+//power on state with the cartridge left in. everything is cleared directly instead of
+//written through ld, so no hooks fire. battery ram keeps its contents
+void mmu::reset() {
+
+    std::memset(WRAM_1, 0, sizeof(WRAM_1));
+    std::memset(WRAM_2, 0, sizeof(WRAM_2));
+    std::memset(HRAM, 0, sizeof(HRAM));
+    std::memset(IO, 0, sizeof(IO));
+    IO[0x00] = 0x30; //joypad, nothing selected
 
-    if (address >= 0 && address <= 0x1FFF) { //romBank 0
-        ERAM_ENABLE = data % 0x0F;
+    interrupts = 0;
+    interrupt_pending = 0;
+    div = 0;
+    TIMA = TMA = TAC = 0;
+    dma_cycles = 0;
+    dma_source = 0;
+    dma_copied = 0;
+    bootRomEnabled = true;
+
+    serial.reset();
+    if (graphics) {
+        graphics->reset();
     }
-    else if (address >= 0x2000 && address <= 0x3FFF) { //switch rom bank number
-        
-        uint8_t bank_value = data & 0b00011111;
 
+    mbc->reset(); //banking registers back to power on, an mbc3 clock keeps running
+    remap();
+}
 
-        if (bank_value == 0x00 || bank_value == 0x20 || 
-            bank_value == 0x40 || bank_value == 0x60) {
-            bank_value += 1;
+//io registers as the dmg boot rom leaves them, the lcd ones are set on the ppu
+static const struct { uint8_t reg; uint8_t value; } io_post_boot[] = {
+    {0x00, 0x00}, {0x0F, 0x01}, {0x46, 0xFF},
+    {0x10, 0x80}, {0x11, 0xBF}, {0x12, 0xF3}, {0x13, 0xFF}, {0x14, 0xBF},
+    {0x16, 0x3F}, {0x18, 0xFF}, {0x19, 0xBF},
+    {0x1A, 0x7F}, {0x1B, 0xFF}, {0x1C, 0x9F}, {0x1D, 0xFF}, {0x1E, 0xBF},
+    {0x20, 0xFF}, {0x23, 0xBF},
+    {0x24, 0x77}, {0x25, 0xF3}, {0x26, 0xF1},
+};
+
+//straight after a reset, puts the machine where the boot rom would hand over to the
+//cartridge at 0x0100: boot rom unmapped, post boot io values and the logo in vram.
+//the cpu registers are up to the cpu
+void mmu::skip_boot_rom() {
+
+    for (auto& reg : io_post_boot) {
+        IO[reg.reg] = reg.value;
+    }
+    div = 0xAB00;
+    update_interrupt_pending();
+
+    if (graphics) {
+        graphics->LCDC = 0x91;
+        graphics->STAT = 0x85;
+        graphics->BGP  = 0xFC;
+        graphics->OBP0 = graphics->OBP1 = 0xFF;
+
+        //the logo from the header, every bit doubled both ways into tiles 1 - 24
+        uint8_t* tile = graphics->VRAM + 0x10;
+        for (int i = 0x104; i < 0x134; i++) {
+            uint8_t logo = cart.romBank[i];
+            for (int nibble = 4; nibble >= 0; nibble -= 4) {
+                uint8_t row = 0;
+                for (int bit = 3; bit >= 0; bit--) {
+                    row = (row << 2) | (((logo >> (nibble + bit)) & 1) * 0x3);
+                }
+                tile[0] = tile[2] = row;
+                tile += 4;
+            }
+        }
+        for (int i = 0; i < 8; i++) { //the (R) from the boot rom as tile 25
+            tile[i * 2] = bootRom[0xD8 + i];
         }
+        graphics->invalidate_tiles();
+
+        //tile map, 0x19 above the end of the top row and the two rows of the logo
+        graphics->VRAM[0x1910] = 0x19;
+        uint8_t next = 0x19;
+        for (uint16_t row_end : {0x192F, 0x190F}) {
+            for (int col = 0; col < 12; col++) {
+                graphics->VRAM[row_end - col] = --next;
+            }
+        }
+    }
 
-        rom_bank_number = (rom_bank_number & 0b11100000) | bank_value;
+    bootRomEnabled = false;
+    map_rom();
+}
+
+//rebuild the whole page table
+void mmu::remap() {
+
+    for (int page = 0xC0; page <= 0xFD; page++) { //wram and its echo never move
+        uint8_t* wram = ((page & 0x1F) < 0x10) ? WRAM_1 : WRAM_2;
+        read_page[page] = write_page[page] = wram + (page & 0x0F) * 0x100;
     }
-    else if (address >= 0x4000 && address <= 0x5FFF) {
 
+    map_rom();
+    map_vram();
+    map_eram();
+}
 
-        data &= 0b00000011;
-        ram_bank_number = data;
+//0x0000 - 0x7FFF, after boot rom and bank switches. rom is never written through the table
+void mmu::map_rom() {
 
+    if (dma_cycles) {
+        return; //the bus is unmapped for the transfer, remap() at the end catches up
+    }
 
+    uint16_t low = mbc->low_rom_bank();
+    uint16_t high = mbc->high_rom_bank();
+
+    if (low != rom_bank0 || high != rom_bank) {
+        rom_map_version++;
+    }
+
+    rom_bank0 = low;
+    rom_bank = high;
+    rom_bank_base = cart.romBank + rom_bank * 0x4000;
+
+    const uint8_t* bank0 = cart.romBank + rom_bank0 * 0x4000;
+
+    read_page[0x00] = bootRomEnabled ? bootRom : bank0;
+
+    for (int page = 0x01; page <= 0x3F; page++) {
+        read_page[page] = bank0 + page * 0x100;
+    }
+
+    for (int page = 0x40; page <= 0x7F; page++) {
+        read_page[page] = rom_bank_base + (page - 0x40) * 0x100;
     }
-    else if (address >= 0x6000 && address <= 0x7FFF) {
+}
+
+//0x8000 - 0x9FFF, after the ppu changes vramRestrict
+void mmu::map_vram() {
+
+    if (dma_cycles) {
+        return; //the bus is unmapped for the transfer, remap() at the end catches up
+    }
+
+    uint8_t* vram = (graphics && !graphics->vramRestrict) ? graphics->VRAM : nullptr;
+
+    for (int page = 0x80; page <= 0x9F; page++) {
+        read_page[page] = write_page[page] = vram ? vram + (page - 0x80) * 0x100 : nullptr;
+    }
+    for (int page = 0x80; page <= 0x97; page++) {
+        write_page[page] = nullptr; //tile data writes go through ld, the ppu's decoded tiles follow them
+    }
+}
+
+//0xA000 - 0xBFFF, after ram enable and ram bank writes
+void mmu::map_eram() {
+
+    if (dma_cycles) {
+        return; //the bus is unmapped for the transfer, remap() at the end catches up
+    }
+
+    int bank = mbc->ram_bank();
+    bool was_mapped = eram_bank_base != nullptr;
+
+    eram_bank_base = (bank < 0) ? nullptr : cart.ERAM + (bank % cart.ram->banks()) * 0x2000;
+
+    //battery ram is written through ld so the pages it touches get marked dirty
+    uint8_t* writable = cart.ram->persistent() ? nullptr : eram_bank_base;
+
+    for (int page = 0xA0; page <= 0xBF; page++) {
+        read_page[page] = eram_bank_base ? eram_bank_base + (page - 0xA0) * 0x100 : nullptr;
+        write_page[page] = writable ? writable + (page - 0xA0) * 0x100 : nullptr;
+    }
+
+    if (was_mapped && !eram_bank_base) {
+        cart.ram->request_flush(); //the game is done with the ram for now
+    }
+}
+
+
+void mmu::ld(uint8_t data, uint16_t address) {
 
-        // banking_mode = data & 0x1;
+    uint8_t* page = write_page[address >> 8];
+    if (page) {
+        page[address & 0xFF] = data;
+        return;
+    }
 
+    if (address <= 0x7FFF) { //mbc registers
+        mbc->write(data, address);
+        map_rom();
+        map_eram();
     }
     else if (address >= 0x8000 && address <= 0x9FFF) {
         if (!graphics) return;
@@ -48,23 +302,18 @@ void mmu::ld(uint8_t data, uint16_t address) {
             return;
         } else {
             graphics->VRAM[address - 0x8000] = data;
+            graphics->vram_written(address - 0x8000);
             return; 
         }
     }
     else if (address >= 0xA000 && address <= 0xBFFF) { //External Cartridge Ram
-        if ((ERAM_ENABLE & 0x0F) != 0x0A) {
-            return;
+        if (eram_bank_base) {
+            eram_bank_base[address - 0xA000] = data;
+            cart.ram->mark_dirty((eram_bank_base - cart.ERAM) + (address - 0xA000));
+        } else {
+            mbc->write_ram(*cart.ram, data, address);
         }
 
-        uint8_t bank = (banking_mode == 0)
-            ? 0
-            : (ram_bank_number & 0b00000011);
-
-        size_t offset = (address - 0xA000) + (bank * 0x2000);
-        if (offset < 0x8000) {
-            cart.ERAM[offset] = data;
-        }
-        
     }
     else if (address >= 0xC000 && address <= 0xCFFF) { //WRAM 1
         WRAM_1[address - 0xC000] = data;    
@@ -89,65 +338,27 @@ void mmu::ld(uint8_t data, uint16_t address) {
             return; 
         } else {
             graphics->OAM[address - 0xFE00] = data;
+            graphics->oam_written();
             return;
         }
     }
     else if (address >= 0xFEA0 && address <= 0xFEFF) {
         return; 
     }
-    else if (address == 0xFF00) {
-
-        uint8_t temp = IO[0] & 0x0F;
-        data |= temp;
-        IO[0] = data | 0xC0;
-
-    }
-    else if (address == 0xFF01) {
-        std::cout << std::hex << data;
-        IO[1] = data;
-    }
-    else if (address == 0xFF02) {
-        IO[2] = data;
-
-        if (data & 0x80) {
-
-            IO[2] &= ~0x80; 
-            IO[0x0F] |= 0x08;
-        }
-    }
-    else if (address == 0xFF04) {
-        div = 0;
-    }
-    else if (address == 0xFF0F) { // Interrupt Flag
-        IO[0x0F] = (data & 0x1F) | 0xE0;
-        return;
-    }
-    else if (address == 0xFF44) {
-        return;
-    }
-    else if (address == 0xFF46) { //OAM DMA TRANSFER
-
-        uint16_t source_addr = data * 0x100;
-
-        for (int i = 0; i < 0xA0; i++) {
-            uint8_t byte = rd(source_addr + i);
-            ld(byte, 0xFE00 + i);
-        }
-
-        IO[0x46] = data;
-    }
-    else if (address == 0xFF50) {
-        bootRomEnabled = false; 
-        std::cout << "Boot Rom Disabled!\n";
-    }
     else if (address >= 0xFF00 && address <= 0xFF7F) { //I/O registers
-        IO[address - 0xFF00] = data;
+        io_register& reg = io[address - 0xFF00];
+        if (reg.write) {
+            reg.write(data);
+        } else {
+            IO[address - 0xFF00] = data;
+        }
     }
     else if (address >= 0xFF80 && address <= 0xFFFE) { //HRAM
         HRAM[address - 0xFF80] = data;
     }
     else if (address == 0xFFFF) {
         interrupts = data & 0x00011111;
+        update_interrupt_pending();
     }
     else {
         std::cout << "BAD POKE . ADDRESS: " << std::hex << +address << "\n";
@@ -159,43 +370,21 @@ void mmu::ld(uint8_t data, uint16_t address) {
 
 uint8_t  mmu::rd(uint16_t address) {
 
+    const uint8_t* page = read_page[address >> 8];
+    if (page) {
+        return page[address & 0xFF];
+    }
+
     if (bootRomEnabled && address <= 0x00FF) {
         return bootRom[address];
     } 
 
-    if (address >= 0 && address <= 0x3FFF) { //ROMBANK 0
-        return cart.romBank[address]; 
+    if (address >= 0 && address <= 0x3FFF) { //ROMBANK 0 (MBC1 CAN SWITCH IT TOO)
+        return cart.romBank[address + rom_bank0 * 0x4000];
     }
     else if (address >= 0x4000 && address <= 0x7FFF) { //ROMBANK 1 (CHANGES DEPENDING ON MAPPER)
 
-        uint8_t mapper = cart.romBank[0x147];
-
-        if (mapper != 0) {
-
-            if (banking_mode == 0){
-                rom_bank_number_final = rom_bank_number & 0b00011111;
-            } else if (banking_mode == 1) {
-
-                uint8_t upper_bits = ram_bank_number << 5; 
-                rom_bank_number_final = (rom_bank_number & 0b00011111) | upper_bits;
-            }
-
-            if (mapper == 0x1B) {
-                if (rom_bank_number_final == 0) {
-                    rom_bank_number_final == 0;
-                }
-            } else {
-                if (rom_bank_number_final == 0x20 || 
-                    rom_bank_number_final == 0x40 || rom_bank_number_final == 0x60) {
-                    rom_bank_number_final += 1;
-                }
-            }
-            return cart.romBank[(address - 0x4000) + (rom_bank_number_final * 0x4000)];
-
-        } else {
-
-            return cart.romBank[address];
-        }
+        return rom_bank_base[address - 0x4000];
 
     }
     else if (address >= 0x8000 && address <= 0x9FFF) {
@@ -207,23 +396,11 @@ uint8_t  mmu::rd(uint16_t address) {
         }
     }
     else if (address >= 0xA000 && address <= 0xBFFF) { //External Cartridge Ram
-        
-        if ((ERAM_ENABLE & 0x0F) != 0x0A) {
-            return 0xFF;
-        }
 
-        uint8_t bank;
-        
-        if (banking_mode == 0) { 
-            bank = 0;
-        } else {
-            bank = ram_bank_number & 0b00000011; 
-        }
-        size_t offset = (address - 0xA000) + (bank * 0x2000);
-
-        if (offset < 0x8000) {
-            return cart.ERAM[offset];
+        if (!eram_bank_base) {
+            return mbc->read_ram(*cart.ram, address);
         }
+        return eram_bank_base[address - 0xA000];
 
     }
     else if (address >= 0xC000 && address <= 0xCFFF) { //WRAM 1
@@ -253,35 +430,9 @@ uint8_t  mmu::rd(uint16_t address) {
     else if (address >= 0xFEA0 && address <= 0xFEFF) {
         return 0xFF; 
     }
-    else if (address == 0xFF00) { //INPUT READ
-
-        uint8_t state = IO[0];
-        uint8_t output = state | 0x0F;
-
-        if (!(state & 0x10)) { 
-            output &= g_polled_directions;
-        }
-        if (!(state & 0x20)) { 
-            output &= g_polled_actions; 
-        }
-
-        return output | 0xC0;
-
-    } 
-    else if (address == 0xFF01) {
-        return IO[1];
-    }
-    else if (address == 0xFF04) {
-        return (div & 0xFF00) >> 8;
-    }
-    else if (address == 0xFF0F) {
-        return IO[0x0F] | 0xE0;
-    }
-    else if (address == 0xFF44) {
-        return graphics->LY;
-    }
     else if (address >= 0xFF00 && address <= 0xFF7F) { // I/O registers
-        return IO[address - 0xFF00];
+        const io_register& reg = io[address - 0xFF00];
+        return (reg.read ? reg.read() : IO[address - 0xFF00]) | reg.unused;
     }
     else if (address >= 0xFF80 && address <= 0xFFFE) { //HRAM
         return HRAM[address - 0xFF80];
@@ -295,4 +446,50 @@ uint8_t  mmu::rd(uint16_t address) {
     return 0xFF;
 }
 
+//oam dma from source_page * 0x100. the page table is emptied so every cpu access
+//outside io and hram goes through mmu_bus, which blocks it until step_dma is done
+void mmu::start_dma(uint8_t source_page) {
+
+    dma_source = source_page * 0x100;
+    dma_copied = 0;
+
+    //rom, wram or any other plain memory can't change while the cpu is locked out,
+    //so when the ppu won't look at oam before the transfer ends (the usual dma in
+    //vblank) the whole of it lands in oam straight away. otherwise, or when asked
+    //for accuracy, oam fills byte by byte in step_dma
+    const uint8_t* source = read_page[source_page];
+    bool unseen = graphics && (graphics->LCDC & 0x80) && graphics->cycles_until_oam_search() > DMA_CYCLES;
+    if (source && unseen && !accurate_dma) {
+        std::memcpy(graphics->OAM, source, sizeof(graphics->OAM));
+        dma_copied = sizeof(graphics->OAM);
+        graphics->oam_written();
+    }
+
+    dma_cycles = DMA_CYCLES;
+
+    for (int page = 0x00; page <= 0xFD; page++) {
+        read_page[page] = write_page[page] = nullptr;
+    }
+}
+
+void mmu::step_dma(int cycles) {
+
+    dma_cycles = (cycles < dma_cycles) ? dma_cycles - cycles : 0;
+
+    int due = (DMA_CYCLES - dma_cycles) / 4;
+    while (graphics && dma_copied < due) {
+        graphics->OAM[dma_copied] = rd(dma_source + dma_copied);
+        graphics->oam_written();
+        dma_copied++;
+    }
 
+    if (!dma_cycles) {
+        remap();
+    }
+}
+
+//used by the timer, ppu and serial port to raise IF bits
+void mmu::request_interrupt(uint8_t mask) {
+    IO[0x0F] |= mask;
+    update_interrupt_pending();
+}
@@ -3,13 +3,29 @@
 #include <iostream>
 #include <cstdint>
 #include <cstddef>
+#include <functional>
 
 #include "ppu.hpp"
+#include "mapper.hpp"
+#include "rom.hpp"
+#include "save.hpp"
+#include "serial.hpp"
 
 class cartridge {
     public:
-        uint8_t romBank[8388608];
-        uint8_t ERAM[32768];
+        std::shared_ptr<const rom_image> rom = rom_image::blank(); //shared between emulators running the same file
+        const uint8_t* romBank = rom->data();
+        std::unique_ptr<save_ram> ram = save_ram::in_memory(0x2000); //sized from the header, kept in a .sav with a battery
+        uint8_t* ERAM = ram->data();
+};
+
+//one io register (0xFF00 - 0xFF7F). without hooks it is a plain byte in mmu::IO,
+//a peripheral that owns it hooks the reads and/or writes (see mmu::hook_io).
+//bits set in unused always read back as 1
+struct io_register {
+    uint8_t unused = 0xFF;
+    std::function<uint8_t()> read;
+    std::function<void(uint8_t)> write;
 };
 
 class mmu {
@@ -19,38 +35,77 @@ class mmu {
 
     public:
 
-        cartridge cart;
+        mmu();
 
-        uint8_t Single_Step_RAM[0xFFFF]; // for single step tests
-        bool single_step_enabled = false;
+        cartridge cart;
 
         uint8_t dataRet = 0;
 
         uint16_t div = 0;
 
+        //timer, ticked by the main loop alongside div
+        uint8_t TIMA = 0;
+        uint8_t TMA  = 0;
+        uint8_t TAC  = 0;
+
         //WRAM 1 & 2
         uint8_t WRAM_1[4096];
         uint8_t WRAM_2[4096];  
         uint8_t HRAM[127]; 
         bool bootRomEnabled = true;
     
+        //page table, one entry per 256 bytes of address space. an entry points at the
+        //host memory behind that page, nullptr sends the access through the handlers in
+        //rd/ld (io, mbc registers, oam, restricted vram, disabled eram, the boot rom on writes)
+        const uint8_t* read_page[256] = {nullptr};
+        uint8_t* write_page[256] = {nullptr};
+
         //io registers
         uint8_t IO[128];
+        io_register io[128];
+        void hook_io(uint16_t address, std::function<uint8_t()> read, std::function<void(uint8_t)> write);
+
+        serial_port serial{*this};
         uint8_t interrupts = 0; 
+        uint8_t interrupt_pending = 0; //IE & IF, kept up to date by every write to either
+
+        //memory bank controller, chosen from the header by load_mapper()
+        std::unique_ptr<mapper> mbc = make_mapper(0x00, 2);
+
+        //oam dma, started by a write to 0xFF46. the cpu only reaches io and hram until it is done
+        static const int DMA_CYCLES = 640; //one byte every 4 cycles
+        int dma_cycles = 0;    //left in the current transfer
+        uint16_t dma_source = 0;
+        int dma_copied = 0;    //bytes already in oam
+        bool accurate_dma = false; //always copy in step with the transfer, even when the ppu couldn't tell
 
-        uint8_t mapper = rd(0x147);
+        void start_dma(uint8_t source_page);
+        void step_dma(int cycles);
+        void tick_dma(int cycles) { if (dma_cycles) step_dma(cycles); }
+        bool dma_blocks(uint16_t address) const { return dma_cycles && address < 0xFF00; }
 
-        uint8_t ERAM_ENABLE = 0;
-        uint8_t rom_bank_number = 0;
-        uint8_t ram_bank_number = 0;
-        uint8_t banking_mode = 0;
-        uint8_t rom_bank_number_final = 0;
-        uint8_t ram_bank_number_final = 0;
+        uint32_t rom_map_version = 0; //bumped whenever a different rom bank gets mapped
+
+        //effective banks, worked out once per banking register write instead of per access
+        uint16_t rom_bank0 = 0;
+        uint16_t rom_bank = 1;
+        const uint8_t* rom_bank_base = cart.romBank + 0x4000; //host memory behind 0x4000 - 0x7FFF
+        uint8_t* eram_bank_base = nullptr;              //host memory behind 0xA000 - 0xBFFF, nullptr while disabled
 
         void ld(uint8_t data, uint16_t address);
         uint8_t rd(uint16_t address);
+        void request_interrupt(uint8_t mask);
+        void update_interrupt_pending() { interrupt_pending = rd(0xFFFF) & rd(0xFF0F); }
         void connect_ppu(ppu* ppu_ptr); 
 
+        void insert_cartridge(std::shared_ptr<const rom_image> rom);
+        void reset();
+        void skip_boot_rom();
+        void remap();
+        void map_rom();
+        void map_vram();
+        void map_eram();
+
         uint8_t bootRom[256] = {
             0x31, 0xfe, 0xff, 0xaf, 0x21, 0xff, 0x9f, 0x32, 0xcb, 0x7c, 0x20, 0xfb,
             0x21, 0x26, 0xff, 0xe, 0x11, 0x3e, 0x80, 0x32, 0xe2, 0xc, 0x3e, 0xf3, 0xe2,
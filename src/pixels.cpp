@@ -0,0 +1,189 @@
+#include "pixels.hpp"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PIXELS_X86
+#include <immintrin.h>
+#endif
+
+
+//reference versions, also what runs on anything that isn't x86
+
+static void decode_row_scalar(uint8_t low, uint8_t high, uint8_t* pixels, uint8_t* flipped) {
+
+    for (int x = 0; x < 8; x++) {
+        int bit = 7 - x;
+        uint8_t color_index = ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+        pixels[x] = color_index;
+        flipped[7 - x] = color_index;
+    }
+}
+
+static void apply_palette_scalar(const uint8_t* indices, uint8_t palette, uint8_t* colors, int count) {
+
+    for (int i = 0; i < count; i++) {
+        colors[i] = (palette >> (indices[i] * 2)) & 0b11;
+    }
+}
+
+static void merge_sprite_scalar(uint8_t* colors, const uint8_t* bg_indices, const uint8_t* sprite, uint8_t palette, bool behind_bg) {
+
+    for (int x = 0; x < 8; x++) {
+        if (sprite[x] == 0) continue; //0 is transparent
+        if (behind_bg && bg_indices[x] != 0) continue;
+        colors[x] = (palette >> (sprite[x] * 2)) & 0b11;
+    }
+}
+
+
+#ifdef PIXELS_X86
+
+//sse2, part of every x86-64 (checked for on 32 bit). no byte shuffle here, so palettes are applied by
+//comparing against each of the 4 indices
+
+__attribute__((target("sse2")))
+static void decode_row_sse2(uint8_t low, uint8_t high, uint8_t* pixels, uint8_t* flipped) {
+
+    //lanes 0 - 7 test bits 7 to 0 for pixels, lanes 8 - 15 bits 0 to 7 for flipped
+    const __m128i bits = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                       0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+
+    __m128i lo = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(low), bits), bits);
+    __m128i hi = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(high), bits), bits);
+    __m128i indices = _mm_or_si128(_mm_and_si128(lo, _mm_set1_epi8(1)), _mm_and_si128(hi, _mm_set1_epi8(2)));
+
+    _mm_storel_epi64((__m128i*)pixels, indices);
+    _mm_storel_epi64((__m128i*)flipped, _mm_srli_si128(indices, 8));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i palette_sse2(__m128i indices, uint8_t palette) {
+
+    __m128i colors = _mm_setzero_si128();
+    for (int i = 0; i < 4; i++) {
+        __m128i match = _mm_cmpeq_epi8(indices, _mm_set1_epi8(i));
+        colors = _mm_or_si128(colors, _mm_and_si128(match, _mm_set1_epi8((palette >> (i * 2)) & 0b11)));
+    }
+    return colors;
+}
+
+__attribute__((target("sse2")))
+static void apply_palette_sse2(const uint8_t* indices, uint8_t palette, uint8_t* colors, int count) {
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(indices + i));
+        _mm_storeu_si128((__m128i*)(colors + i), palette_sse2(v, palette));
+    }
+    apply_palette_scalar(indices + i, palette, colors + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void merge_sprite_sse2(uint8_t* colors, const uint8_t* bg_indices, const uint8_t* sprite, uint8_t palette, bool behind_bg) {
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i obj  = _mm_loadl_epi64((const __m128i*)sprite);
+    __m128i line = _mm_loadl_epi64((const __m128i*)colors);
+
+    __m128i hidden = _mm_cmpeq_epi8(obj, zero); //lanes the sprite leaves alone
+    if (behind_bg) {
+        __m128i bg_opaque = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i*)bg_indices), zero), _mm_set1_epi8(-1));
+        hidden = _mm_or_si128(hidden, bg_opaque);
+    }
+
+    __m128i merged = _mm_or_si128(_mm_and_si128(hidden, line), _mm_andnot_si128(hidden, palette_sse2(obj, palette)));
+    _mm_storel_epi64((__m128i*)colors, merged);
+}
+
+
+//avx2, checked for at runtime. palettes become a byte shuffle and the background
+//goes through 32 pixels at a time
+
+__attribute__((target("avx2")))
+static void apply_palette_avx2(const uint8_t* indices, uint8_t palette, uint8_t* colors, int count) {
+
+    const __m256i table = _mm256_setr_epi8(
+        palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(indices + i));
+        _mm256_storeu_si256((__m256i*)(colors + i), _mm256_shuffle_epi8(table, v));
+    }
+    apply_palette_sse2(indices + i, palette, colors + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void merge_sprite_avx2(uint8_t* colors, const uint8_t* bg_indices, const uint8_t* sprite, uint8_t palette, bool behind_bg) {
+
+    const __m128i table = _mm_setr_epi8(palette & 3, (palette >> 2) & 3, (palette >> 4) & 3, (palette >> 6) & 3,
+                                        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i obj  = _mm_loadl_epi64((const __m128i*)sprite);
+    __m128i line = _mm_loadl_epi64((const __m128i*)colors);
+
+    __m128i shown = _mm_xor_si128(_mm_cmpeq_epi8(obj, zero), _mm_set1_epi8(-1));
+    if (behind_bg) {
+        shown = _mm_and_si128(shown, _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i*)bg_indices), zero));
+    }
+
+    _mm_storel_epi64((__m128i*)colors, _mm_blendv_epi8(line, _mm_shuffle_epi8(table, obj), shown));
+}
+
+#endif
+
+
+static const pixel_kernels scalar_kernels = {"scalar", decode_row_scalar, apply_palette_scalar, merge_sprite_scalar};
+
+#ifdef PIXELS_X86
+static const pixel_kernels sse2_kernels = {"sse2", decode_row_sse2, apply_palette_sse2, merge_sprite_sse2};
+static const pixel_kernels avx2_kernels = {"avx2", decode_row_sse2, apply_palette_avx2, merge_sprite_avx2}; //a tile row is only 16 bytes
+
+static bool has_sse2() {
+#ifdef __x86_64__
+    return true;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+const pixel_kernels* find_pixel_kernels(const char* name) {
+
+    if (std::strcmp(name, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+#ifdef PIXELS_X86
+    if (std::strcmp(name, "sse2") == 0 && has_sse2()) {
+        return &sse2_kernels;
+    }
+    if (std::strcmp(name, "avx2") == 0 && has_avx2()) {
+        return &avx2_kernels;
+    }
+#endif
+    return nullptr;
+}
+
+const pixel_kernels& best_pixel_kernels() {
+
+    static const pixel_kernels* best = [] {
+        static const char* const fastest_first[] = {"avx2", "sse2"};
+        for (const char* name : fastest_first) {
+            if (const pixel_kernels* kernels = find_pixel_kernels(name)) {
+                return kernels;
+            }
+        }
+        return &scalar_kernels;
+    }();
+
+    return *best;
+}
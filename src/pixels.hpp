@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+//the ppu's per pixel inner loops, as a plain c++ reference and vectorized for the
+//host. every set gives exactly the same output, the best one the cpu supports is
+//picked at startup (see best_pixel_kernels)
+struct pixel_kernels {
+
+    const char* name;
+
+    //one tile row, the low and high bitplanes interleaved into 8 colour indices,
+    //left to right into pixels and right to left into flipped
+    void (*decode_row)(uint8_t low, uint8_t high, uint8_t* pixels, uint8_t* flipped);
+
+    //colour indices through a BGP / OBP style palette, 2 bits per index
+    void (*apply_palette)(const uint8_t* indices, uint8_t palette, uint8_t* colors, int count);
+
+    //8 sprite pixels over the line. index 0 is transparent, with behind_bg set the
+    //sprite only shows where the background index is 0
+    void (*merge_sprite)(uint8_t* colors, const uint8_t* bg_indices, const uint8_t* sprite, uint8_t palette, bool behind_bg);
+};
+
+const pixel_kernels& best_pixel_kernels();
+
+//a set by name ("scalar", "sse2", "avx2"), nullptr when this cpu can't run it
+const pixel_kernels* find_pixel_kernels(const char* name);
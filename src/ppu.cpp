@@ -1,6 +1,75 @@
 #include "ppu.hpp"
 #include "mmu.hpp"
 
+#include <cstring>
+#include <algorithm>
+
+//takes over the lcd registers from the mmu. LY can only be read, the mode and
+//coincidence bits of STAT only by the cpu
+void ppu::connect_io() {
+
+    struct { uint16_t address; uint8_t* value; } owned[] = {
+        {0xFF42, &SCY}, {0xFF43, &SCX}, {0xFF45, &LYC}, {0xFF47, &BGP},
+        {0xFF48, &OBP0}, {0xFF49, &OBP1}, {0xFF4A, &WY}, {0xFF4B, &WX},
+    };
+
+    for (auto& reg : owned) {
+        uint8_t* value = reg.value;
+        mem.hook_io(reg.address, [value]() { return *value; }, [value](uint8_t data) { *value = data; });
+    }
+
+    mem.hook_io(0xFF40, [this]() { return LCDC; }, [this](uint8_t data) {
+        if ((data ^ LCDC) & 0x04) {
+            oam_written(); //sprite height changed, the bins cover different lines
+        }
+        LCDC = data;
+    });
+
+    mem.hook_io(0xFF41, [this]() { return STAT; }, [this](uint8_t data) { STAT = (data & 0x78) | (STAT & 0x07); });
+
+    mem.hook_io(0xFF44, [this]() { return LY; }, [](uint8_t) {});
+}
+
+//power on: memory, registers and the position in the frame all cleared
+void ppu::reset() {
+
+    std::memset(VRAM, 0, sizeof(VRAM));
+    std::memset(OAM, 0, sizeof(OAM));
+    std::memset(spritebuffer, 0, sizeof(spritebuffer));
+    std::memset(screenBuffer, 0, sizeof(screenBuffer));
+
+    LCDC = STAT = SCY = SCX = LYC = BGP = OBP0 = OBP1 = WY = WX = 0;
+    LY = 0;
+    clocks = 0;
+    x = 0;
+    spritesFound = 0;
+    fetcher_tile_x = 0;
+
+    oamRestrict = vramRestrict = false;
+    vblank = ly_equals_wy = window_fetch = false;
+
+    background_fifo.clear();
+    invalidate_tiles();
+    oam_written();
+}
+
+//vram changed behind the cache's back (reset, boot logo), decode everything again when drawn
+void ppu::invalidate_tiles() {
+    std::fill(tile_row_stale, tile_row_stale + TILE_ROWS, true);
+}
+
+const uint8_t* ppu::tile_row(uint16_t offset, bool x_flip) {
+
+    int row = offset >> 1;
+
+    if (tile_row_stale[row]) {
+        kernels->decode_row(VRAM[row * 2], VRAM[row * 2 + 1], tile_rows[row], tile_rows_flipped[row]);
+        tile_row_stale[row] = false;
+    }
+
+    return x_flip ? tile_rows_flipped[row] : tile_rows[row];
+}
+
 void ppu::tick() { //starts at 1
 
     clocks++; //increment clocks ONCE per tick
@@ -9,39 +78,27 @@ void ppu::tick() { //starts at 1
         if (clocks == 1 && LY < 144) {  //OAM SEARCH (ONLY OAM CANNOT BE ACCESSED)
             set_ppu_mode(oamsearch);
 
-            spritesFound = 0;
-            for (int i = 0; i < 40; i++) {
-
-                uint8_t sprite_Y = OAM[i * 4];
-                uint8_t sprite_X = OAM[i * 4 + 1];
-                uint8_t tile_number = OAM[i * 4 + 2];
-                uint8_t sprite_flags = OAM[i * 4 + 3];
-
-                int spriteHeight = (mem.rd(0xFF40) & 0x04) ? 16 : 8;
-                if (((sprite_X + 8) > 0) && ((LY + 16) >= sprite_Y) && ((LY + 16) < (sprite_Y + spriteHeight))) {
-                    spritesFound++;
-                    if (spritesFound <= FINDABLE_SPRITES) {
-                        addSprite(spritesFound - 1, sprite_Y, sprite_X, tile_number, sprite_flags);
-                    } else {
-                        
-                    }
-                }
+            if (sprite_bins_stale) {
+                rebuild_sprite_bins((LCDC & 0x04) ? 16 : 8);
+            }
+
+            spritesFound = sprite_bin_count[LY];
+            for (int i = 0; i < spritesFound; i++) {
+                const uint8_t* sprite = OAM + sprite_bins[LY][i] * 4;
+                addSprite(i, sprite[0], sprite[1], sprite[2], sprite[3]);
             }
 
-            vramRestrict = false;
-            oamRestrict = true;
+            set_restrictions(true, false);
         }
         else if (clocks == 80) { //Pixel Transfer (VRAM & OAM CANNOT BE ACCESSED)
             set_ppu_mode(pixeltransfer);
             render_scanline(LY);
-            oamRestrict = true;
-            vramRestrict = true;
+            set_restrictions(true, true);
 
         }
         else if (clocks == 252) { //H-Blank (VRAM AND OAM CAN BE ACCESSED)
             set_ppu_mode(h_blank);
-            oamRestrict = false;
-            vramRestrict = false;
+            set_restrictions(false, false);
         }
     }
     if (clocks >= 456) { // NEW SCAN LINE
@@ -50,30 +107,20 @@ void ppu::tick() { //starts at 1
         x = 0;
         LY++;
 
-        uint8_t LYC = mem.rd(0xFF45);
-
         if (LY == LYC) {
             
-            uint8_t STAT = mem.rd(0xFF41); //STAT
             STAT |= 0x2; //enable flag for LY == LYC
-            mem.ld(STAT, 0xFF41);
 
-            //set v-blank
-            uint8_t IF = mem.rd(0xFF0F);
-            IF |= 0x2;
-            mem.ld(IF, 0xFF0F);
+            mem.request_interrupt(0x2); //stat
 
         }
 
         if (LY == 144) { //ENTER VBLANK SCANLINE PERIOD
 
             //set v-blank interrupt flag
-            uint8_t temp = mem.rd(0xFF0F);
-            temp |= 0x1;
-            mem.ld(temp, 0xFF0F);
+            mem.request_interrupt(0x1);
 
-            oamRestrict = false;
-            vramRestrict = false;
+            set_restrictions(false, false);
             set_ppu_mode(v_blank);
         }
         if (LY > 153) { //ENTER OAM SEARCH AFTER LAST VBLANK LINE
@@ -81,8 +128,113 @@ void ppu::tick() { //starts at 1
             LY = 0;
 
         } 
+    }
+}
+
+//sort every sprite into the lines it covers, done once instead of scanning oam every line
+void ppu::rebuild_sprite_bins(int height) {
+
+    std::memset(sprite_bin_count, 0, sizeof(sprite_bin_count));
+
+    for (int i = 0; i < 40; i++) {
 
-        mem.ld(LY, 0xFF44); //updates LY register
+        int top = OAM[i * 4] - 16;
+        uint8_t sprite_X = OAM[i * 4 + 1];
+
+        for (int line = std::max(top, 0); line < std::min(top + height, GB_HEIGHT); line++) {
+
+            int count = sprite_bin_count[line];
+            if (count == FINDABLE_SPRITES) {
+                continue; //the line is full, later sprites in oam aren't found
+            }
+
+            //insert ahead of every sprite that wins over this one, they draw after it
+            uint8_t* bin = sprite_bins[line];
+            int j = count;
+            while (j > 0 && OAM[bin[j - 1] * 4 + 1] <= sprite_X) {
+                bin[j] = bin[j - 1];
+                j--;
+            }
+            bin[j] = i;
+            sprite_bin_count[line] = count + 1;
+        }
+    }
+
+    sprite_bins_stale = false;
+}
+
+//ticks until the next one that changes anything (mode switch, new line and the
+//LY == LYC / vblank interrupts that come with it), counting the next tick as 1
+int ppu::next_event_cycle() {
+
+    int next_action = 456;
+    if (LY < 144) {
+        if (clocks < 1) {
+            next_action = 1;
+        } else if (clocks < 80) {
+            next_action = 80;
+        } else if (clocks < 252) {
+            next_action = 252;
+        }
+    }
+    return next_action - clocks;
+}
+
+//same as calling tick() cycles times, but clocks where tick() has nothing to do are skipped
+void ppu::advance(int cycles) {
+
+    while (cycles > 0) {
+
+        int idle = next_event_cycle() - 1;
+        if (cycles <= idle) {
+            clocks += cycles;
+            return;
+        }
+
+        clocks += idle;
+        cycles -= idle + 1;
+        tick();
+    }
+}
+
+//ticks until the one that raises IF (LY == LYC or vblank), counting the next tick as 1
+int ppu::cycles_until_interrupt() {
+
+    uint8_t line = LY;
+    int cycles = 456 - clocks;
+
+    while (true) { //vblank comes around within 154 lines
+        line++;
+        if (line == LYC || line == 144) {
+            return cycles;
+        }
+        if (line > 153) {
+            line = 0;
+        }
+        cycles += 456;
+    }
+}
+
+//ticks until the next oam search, the first tick of a visible line and the only
+//time the ppu reads oam, counting the next tick as 1
+int ppu::cycles_until_oam_search() {
+
+    if (LY < 144 && clocks < 1) {
+        return 1 - clocks;
+    }
+
+    uint8_t line = LY;
+    int cycles = 456 - clocks + 1;
+
+    while (true) { //line 0 comes around within 154 lines
+        line++;
+        if (line > 153) {
+            line = 0;
+        }
+        if (line < 144) {
+            return cycles;
+        }
+        cycles += 456;
     }
 }
 
@@ -98,12 +250,6 @@ void ppu::render_scanline(int LY) {
     uint8_t low_byte;
     uint8_t high_byte;
 
-    uint8_t LCDC = mem.rd(0xFF40);
-    uint8_t SCY  = mem.rd(0xFF42);
-    uint8_t SCX  = mem.rd(0xFF43);
-    uint8_t WY   = mem.rd(0xFF4A);
-    uint8_t WX   = mem.rd(0xFF4B);
-
     bool masterEnable = LCDC & 0x80;
     bool wnTileMap    = LCDC & 0x40;
     bool wnEnable     = LCDC & 0x20;
@@ -119,6 +265,9 @@ void ppu::render_scanline(int LY) {
     
     int discard_count = SCX % 8;
     int current_pixel_x = 0;
+
+    uint8_t* bg_line = bg_raw_colors.data() + LINE_PAD;
+    uint8_t* color_line = final_colors.data() + LINE_PAD;
     
     for (int i = 0; i < discard_count; ++i) {
         if (!background_fifo.empty()) {
@@ -140,9 +289,7 @@ void ppu::render_scanline(int LY) {
             uint8_t bg_color_index = background_fifo.front();
             background_fifo.pop_front();
 
-            bg_raw_colors[current_pixel_x] = bg_color_index;
-
-            final_colors[current_pixel_x] = get_color(bg_color_index, palette_address); 
+            bg_line[current_pixel_x] = bg_color_index;
             
             current_pixel_x++;
         } else {
@@ -150,6 +297,8 @@ void ppu::render_scanline(int LY) {
         }
     }
 
+    kernels->apply_palette(bg_line, BGP, color_line, GB_WIDTH);
+
     if (objEnable) {
 
         for (int j = 0; j < spritesFound; j++) {
@@ -185,54 +334,39 @@ void ppu::render_scanline(int LY) {
                     }
                 }
                 
-                uint16_t tile_addr = 0x8000 + tile_index_to_use * 16 + row * 2;
-                uint8_t low_byte  = mem.rd(tile_addr);
-                uint8_t high_byte = mem.rd(tile_addr + 1);
-
-                for (int x = 0; x < 8; x++) { // pixels in the sprite
-
-                    int pixel_x = obj_x - 8 + x; 
-                    if (pixel_x < 0 || pixel_x >= GB_WIDTH) continue; //off-screen rendering
-
-                    int bit = x_flip ? x : 7 - x;
-
-
-                    uint8_t color_index = ((high_byte >> bit) & 1) << 1 | ((low_byte >> bit) & 1);
+                if (obj_x == 0 || obj_x >= GB_WIDTH + 8) continue; //off-screen rendering
 
-                    if (color_index == 0) continue; //0 is transparent
+                const uint8_t* pixels = tile_row(tile_index_to_use * 16 + row * 2, x_flip);
 
-                    if (bg_priority && (bg_raw_colors[pixel_x] != 0)) continue;
-
-                    uint8_t palette_addr = use_palette1 ? 0xFF49 : 0xFF48;
-
-                    uint8_t final_color = get_color(color_index, palette_addr);
-
-                    final_colors[pixel_x] = final_color;
-                }
+                int pixel_x = obj_x - 8; //at most 7 pixels into the padding either side
+                kernels->merge_sprite(color_line + pixel_x, bg_line + pixel_x, pixels, use_palette1 ? OBP1 : OBP0, bg_priority);
             }
         }
     }
 
-    for (int x = 0; x < GB_WIDTH; x++) {
-        int line_start = LY * GB_WIDTH;
-        screenBuffer[line_start + x] = final_colors[x];
-    }
+    std::copy(color_line, color_line + GB_WIDTH, screenBuffer + LY * GB_WIDTH);
 }
 
 
-void ppu::set_ppu_mode(uint8_t mode) {
+//oam and vram access for the cpu, the mmu page table follows vram
+void ppu::set_restrictions(bool oam, bool vram) {
 
-    temp = mem.rd(0xFF41);
-    temp &= 0b11111100;
-    temp |= mode;
-    mem.ld(temp, 0xFF41); 
+    oamRestrict = oam;
 
+    if (vram != vramRestrict) {
+        vramRestrict = vram;
+        mem.map_vram();
+    }
+}
+
+void ppu::set_ppu_mode(uint8_t mode) {
+    STAT = (STAT & 0b11111100) | mode;
 }
 
 
 uint8_t ppu::get_color(uint8_t color_index, uint16_t palette_address) {
 
-    uint8_t palette_data = mem.rd(palette_address);
+    uint8_t palette_data = (palette_address == 0xFF49) ? OBP1 : (palette_address == 0xFF48) ? OBP0 : BGP;
     uint8_t shift = color_index * 2;
     uint8_t final_palette_index = (palette_data >> shift) & 0b11; 
     
@@ -251,17 +385,11 @@ void ppu::addSprite(int i, uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
 }
 
 uint8_t ppu::get_ppu_mode() {
-    return mem.rd(0xFF41) & 0x03;
+    return STAT & 0x03;
 }
 
 void ppu::fetch_tile_row(int current_pixel_x, int scanline_y) {
     
-    uint8_t LCDC = mem.rd(0xFF40);
-    uint8_t SCY  = mem.rd(0xFF42);
-    uint8_t SCX  = mem.rd(0xFF43);
-    uint8_t WY   = mem.rd(0xFF4A);
-    uint8_t WX   = mem.rd(0xFF4B);
-
     bool wnTileMap    = LCDC & 0x40;
     bool wnEnable     = LCDC & 0x20;
     bool bgWinTile    = LCDC & 0x10;
@@ -308,11 +436,9 @@ void ppu::fetch_tile_row(int current_pixel_x, int scanline_y) {
         tile_data_addr = tile_data_addr_base + (signed_tile_num * 16) + tile_y_offset * 2;
     }
 
-    uint8_t low_byte = mem.rd(tile_data_addr);
-    uint8_t high_byte = mem.rd(tile_data_addr + 1);
+    const uint8_t* pixels = tile_row(tile_data_addr - 0x8000, false);
 
-    for (int bit = 7; bit >= 0; bit--) {
-        uint8_t color_index = ((high_byte >> bit) & 1) << 1 | ((low_byte >> bit) & 1);
-        background_fifo.push_back(color_index);
+    for (int x = 0; x < 8; x++) {
+        background_fifo.push_back(pixels[x]);
     }
 }
\ No newline at end of file
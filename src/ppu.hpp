@@ -2,26 +2,54 @@
 
 #include <iostream>
 #include <cstdint>
-#include <deque>
 #include <array>
 
+#include "pixels.hpp"
+
 class mmu;
 const int GB_WIDTH = 160;
 const int GB_HEIGHT = 144;
 
+//background pixels waiting to be shifted out, colour indices. a ring inside the
+//ppu, it never holds more than the 8 pixels left of one fetch plus the next 8
+class pixel_fifo {
+    public:
+
+        static const int CAPACITY = 16;
+
+        bool empty() const { return head == tail; }
+        int size() const { return (uint8_t)(tail - head); }
+        void clear() { head = tail = 0; }
+
+        void push_back(uint8_t pixel) { pixels[tail++ & (CAPACITY - 1)] = pixel; }
+        uint8_t front() const { return pixels[head & (CAPACITY - 1)]; }
+        void pop_front() { head++; }
+
+    private:
+
+        uint8_t pixels[CAPACITY];
+        uint8_t head = 0; //free running, masked on access
+        uint8_t tail = 0;
+};
+
 class ppu {
     private:
 
         mmu& mem;
 
 
-        std::deque<uint8_t> background_fifo;
-        std::array<uint8_t, GB_WIDTH> bg_raw_colors; 
-        std::array<uint8_t, GB_WIDTH> final_colors;
+        pixel_fifo background_fifo;
+        //one line of background indices and final colours, with room for a sprite's
+        //8 pixels hanging off either edge so sprites are merged without clipping
+        static const int LINE_PAD = 8;
+        std::array<uint8_t, LINE_PAD + GB_WIDTH + LINE_PAD> bg_raw_colors{};
+        std::array<uint8_t, LINE_PAD + GB_WIDTH + LINE_PAD> final_colors{};
 
     public:
 
-        ppu(mmu& shared_memory) : mem(shared_memory){};
+        ppu(mmu& shared_memory) : mem(shared_memory){ invalidate_tiles(); };
+
+        const pixel_kernels* kernels = &best_pixel_kernels();
 
         const uint8_t h_blank       = 0b00000000;
         const uint8_t v_blank       = 0b00000001;
@@ -42,7 +70,29 @@ class ppu {
         bool window_fetch = false;
 
         uint8_t VRAM[8192];
-        uint8_t OAM[159];
+        uint8_t OAM[160];
+
+        //tile data (0x8000 - 0x97FF) decoded to colour indices a row of 8 pixels at a time,
+        //as stored and mirrored for x flipped sprites. a vram write marks its row stale
+        //and the row is decoded again the next time it is drawn
+        static const int TILE_ROWS = 384 * 8;
+        uint8_t tile_rows[TILE_ROWS][8];
+        uint8_t tile_rows_flipped[TILE_ROWS][8];
+        bool tile_row_stale[TILE_ROWS];
+
+        void vram_written(uint16_t offset) { if (offset < TILE_ROWS * 2) tile_row_stale[offset >> 1] = true; }
+        void invalidate_tiles();
+        const uint8_t* tile_row(uint16_t offset, bool x_flip); //offset of the row's low byte in vram
+
+        //oam indices of the sprites on each visible line, at most 10 in oam order like the
+        //hardware finds them, kept in drawing order (the sprite that wins on overlap, smallest
+        //X then lowest index, last). rebuilt at the next oam search after oam or LCDC.2 changes
+        uint8_t sprite_bins[GB_HEIGHT][10];
+        uint8_t sprite_bin_count[GB_HEIGHT];
+        bool sprite_bins_stale = true;
+
+        void oam_written() { sprite_bins_stale = true; }
+        void rebuild_sprite_bins(int height);
 
         uint8_t spritebuffer[40] = {0};
         uint8_t screenBuffer[144 * 160] = {0}; //144*160 pixels
@@ -61,12 +111,31 @@ class ppu {
 
         uint8_t LY = 0;
 
+        //lcd registers, owned here and kept current by the io hooks from connect_io
+        uint8_t LCDC = 0;
+        uint8_t STAT = 0;
+        uint8_t SCY  = 0;
+        uint8_t SCX  = 0;
+        uint8_t LYC  = 0;
+        uint8_t BGP  = 0;
+        uint8_t OBP0 = 0;
+        uint8_t OBP1 = 0;
+        uint8_t WY   = 0;
+        uint8_t WX   = 0;
+
         const int FINDABLE_SPRITES = 10;
         int spritesFound = 0;   
         uint8_t fetcher_tile_x = 0;
 
+        void connect_io();
+        void reset();
         void tick();
+        void advance(int cycles);
+        int next_event_cycle();
+        int cycles_until_interrupt();
+        int cycles_until_oam_search();
         void set_ppu_mode(uint8_t mode);
+        void set_restrictions(bool oam, bool vram);
         void addSprite(int i, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
         uint8_t get_ppu_mode();
         void render_scanline(int LY);
@@ -0,0 +1,125 @@
+#include "rom.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#endif
+
+static const size_t MIN_ROM_SIZE = 0x8000;
+
+static bool is_power_of_two(size_t size) {
+    return size && !(size & (size - 1));
+}
+
+//copies the rom into buffer, rounded up to a power of two with 0xFF like an unconnected bus
+void rom_image::pad(std::vector<uint8_t> contents) {
+
+    source_length = contents.size();
+
+    length = MIN_ROM_SIZE;
+    while (length < contents.size()) {
+        length <<= 1;
+    }
+
+    buffer = std::move(contents);
+    buffer.resize(length, 0xFF);
+    bytes = buffer.data();
+}
+
+rom_image::~rom_image() {
+#ifdef ROM_MMAP
+    if (mapping) {
+        munmap(mapping, length);
+    }
+#endif
+}
+
+std::shared_ptr<const rom_image> rom_image::from_bytes(std::vector<uint8_t> contents) {
+
+    std::shared_ptr<rom_image> image(new rom_image());
+    image->pad(std::move(contents));
+    return image;
+}
+
+std::shared_ptr<const rom_image> rom_image::blank() {
+
+    static std::shared_ptr<const rom_image> image = from_bytes(std::vector<uint8_t>());
+    return image;
+}
+
+std::shared_ptr<const rom_image> rom_image::open(const std::string& path) {
+
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<const rom_image>> shared; //by resolved path
+
+    std::string key = path;
+#ifdef ROM_MMAP
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved)) {
+        key = resolved;
+    }
+#endif
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    //images nobody holds anymore leave the map here, it only grows with the roms open at once
+    for (auto entry = shared.begin(); entry != shared.end();) {
+        entry = entry->second.expired() ? shared.erase(entry) : std::next(entry);
+    }
+
+    auto found = shared.find(key);
+    if (found != shared.end()) {
+        if (std::shared_ptr<const rom_image> existing = found->second.lock()) {
+            return existing;
+        }
+    }
+
+    std::shared_ptr<rom_image> image(new rom_image());
+
+#ifdef ROM_MMAP
+    //real cartridges are a power of two in size, those can be used as they are
+    int fd = ::open(key.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size >= (off_t)MIN_ROM_SIZE && is_power_of_two(info.st_size)) {
+
+            void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                image->mapping = mapping;
+                image->bytes = static_cast<const uint8_t*>(mapping);
+                image->length = image->source_length = info.st_size;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (!image->mapped()) {
+
+        std::ifstream file(key, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!file.is_open()) {
+            return nullptr;
+        }
+
+        std::vector<uint8_t> contents(file.tellg());
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char*>(contents.data()), contents.size())) {
+            return nullptr;
+        }
+        image->pad(std::move(contents));
+    }
+
+    image->source_path = key;
+    shared[key] = image;
+    return image;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+//a cartridge rom, read only. mapped straight from the file when the platform allows
+//it, otherwise read in one go. emulators opening the same file share one image
+class rom_image {
+    public:
+
+        //nullptr when the file can't be opened or read
+        static std::shared_ptr<const rom_image> open(const std::string& path);
+
+        //rom built in memory (benchmarks, tests), padded like a file would be
+        static std::shared_ptr<const rom_image> from_bytes(std::vector<uint8_t> bytes);
+
+        //what the bus sees with no cartridge inserted
+        static std::shared_ptr<const rom_image> blank();
+
+        rom_image(const rom_image&) = delete;
+        rom_image& operator=(const rom_image&) = delete;
+        ~rom_image();
+
+        const uint8_t* data() const { return bytes; }
+        size_t size() const { return length; }               //power of two, at least 32kb
+        uint16_t banks() const { return length / 0x4000; }   //16kb banks, what the mapper wraps around
+        size_t file_size() const { return source_length; }   //bytes actually in the file
+        bool mapped() const { return mapping != nullptr; }
+        const std::string& path() const { return source_path; } //empty for from_bytes
+
+    private:
+
+        rom_image() {}
+
+        void pad(std::vector<uint8_t> contents);
+
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+        size_t source_length = 0;
+        std::string source_path;
+
+        void* mapping = nullptr; //mmap of the file, or nullptr when buffer holds the rom
+        std::vector<uint8_t> buffer;
+};
@@ -0,0 +1,161 @@
+#include "save.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SAVE_MMAP
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const std::chrono::seconds FLUSH_INTERVAL(1);
+
+std::unique_ptr<save_ram> save_ram::in_memory(size_t size) {
+
+    std::unique_ptr<save_ram> ram(new save_ram());
+
+    ram->buffer.reset(new uint8_t[size]());
+    ram->bytes = ram->buffer.get();
+    ram->length = size;
+    ram->dirty.reset(new std::atomic<uint8_t>[(size + PAGE_SIZE - 1) / PAGE_SIZE]());
+    return ram;
+}
+
+std::unique_ptr<save_ram> save_ram::open(const std::string& path, size_t size) {
+
+#ifdef SAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::cout << "Could not open save file: " << path << "\n";
+        return in_memory(size);
+    }
+
+    //another emulator already has this save mapped. sharing the mapping would mix both
+    //games' writes into one file, so this one gets a copy that is never written back
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        std::cout << "Save file in use, changes won't be kept: " << path << "\n";
+        std::unique_ptr<save_ram> ram = in_memory(size);
+        if (pread(fd, ram->bytes, size, 0) < 0) { //a short file leaves the rest zero
+            std::cout << "Could not read save file: " << path << "\n";
+        }
+        close(fd);
+        return ram;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (info.st_size < (off_t)size && ftruncate(fd, size) != 0)) {
+        std::cout << "Could not size save file: " << path << "\n";
+        close(fd);
+        return in_memory(size);
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (mapping == MAP_FAILED) {
+        std::cout << "Could not map save file: " << path << "\n";
+        close(fd);
+        return in_memory(size);
+    }
+
+    std::unique_ptr<save_ram> ram(new save_ram());
+    ram->locked_fd = fd; //the lock lasts as long as the descriptor
+    ram->mapping = mapping;
+    ram->bytes = static_cast<uint8_t*>(mapping);
+    ram->length = size;
+    ram->dirty.reset(new std::atomic<uint8_t>[(size + PAGE_SIZE - 1) / PAGE_SIZE]());
+#else
+    std::unique_ptr<save_ram> ram = in_memory(size);
+
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    file.read(reinterpret_cast<char*>(ram->bytes), size);
+#endif
+
+    ram->path = path;
+    ram->start_flusher();
+    return ram;
+}
+
+save_ram::~save_ram() {
+
+    if (flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        flush();
+    }
+
+#ifdef SAVE_MMAP
+    if (mapping) {
+        munmap(mapping, length);
+    }
+    if (locked_fd >= 0) {
+        close(locked_fd);
+    }
+#endif
+}
+
+void save_ram::request_flush() {
+
+    if (!persistent()) {
+        return;
+    }
+
+    //try_lock so the emulation thread never waits on a flush in progress, the
+    //interval picks up anything that got missed
+    std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+    if (guard.owns_lock()) {
+        flush_requested = true;
+        guard.unlock();
+        wake.notify_one();
+    }
+}
+
+void save_ram::start_flusher() {
+
+    flusher = std::thread([this]() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, FLUSH_INTERVAL, [this]() { return stopping || flush_requested; });
+            flush_requested = false;
+
+            guard.unlock();
+            flush();
+            guard.lock();
+        }
+    });
+}
+
+//writes back every page marked since the last flush
+void save_ram::flush() {
+
+    size_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+#ifdef SAVE_MMAP
+    static const size_t host_page = sysconf(_SC_PAGESIZE); //msync wants host page alignment
+
+    for (size_t page = 0; page < pages; page++) {
+        if (dirty[page].exchange(0, std::memory_order_relaxed)) {
+            size_t start = (page * PAGE_SIZE) & ~(host_page - 1);
+            msync(bytes + start, page * PAGE_SIZE + PAGE_SIZE - start, MS_SYNC);
+        }
+    }
+#else
+    bool any = false;
+    for (size_t page = 0; page < pages; page++) {
+        any |= dirty[page].exchange(0, std::memory_order_relaxed) != 0;
+    }
+    if (any) {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(bytes), length);
+    }
+#endif
+}
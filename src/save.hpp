@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//cartridge ram. battery backed carts keep it in a .sav file that is mapped into
+//memory, writes mark the page they touch and a background thread syncs only the
+//dirty pages, every FLUSH_INTERVAL or when the game disables the ram, so the
+//emulation thread never waits on the disk
+class save_ram {
+    public:
+
+        static const size_t PAGE_SIZE = 0x1000;
+
+        //ram that goes away with the emulator
+        static std::unique_ptr<save_ram> in_memory(size_t size);
+
+        //ram kept in path, created or grown to size. falls back to in_memory when
+        //the file can't be opened, or to a copy of it that is never written back when
+        //another emulator holds it
+        static std::unique_ptr<save_ram> open(const std::string& path, size_t size);
+
+        save_ram(const save_ram&) = delete;
+        save_ram& operator=(const save_ram&) = delete;
+        ~save_ram();
+
+        uint8_t* data() { return bytes; }
+        size_t size() const { return length; }
+        int banks() const { return length / 0x2000; }
+        bool persistent() const { return !path.empty(); }
+
+        void mark_dirty(size_t offset) { dirty[offset / PAGE_SIZE].store(1, std::memory_order_relaxed); }
+
+        //wakes the flush thread, returns straight away
+        void request_flush();
+
+    private:
+
+        save_ram() {}
+
+        void start_flusher();
+        void flush();
+
+        uint8_t* bytes = nullptr;
+        size_t length = 0;
+
+        std::string path; //empty for in_memory
+        void* mapping = nullptr;
+        int locked_fd = -1; //open with an exclusive flock while mapped
+        std::unique_ptr<uint8_t[]> buffer;
+
+        std::unique_ptr<std::atomic<uint8_t>[]> dirty; //one flag per PAGE_SIZE
+
+        std::thread flusher;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool flush_requested = false;
+        bool stopping = false;
+};
@@ -0,0 +1,97 @@
+#include "serial.hpp"
+#include "mmu.hpp"
+
+uint8_t capture_transport::exchange(uint8_t out) {
+    if (!sent.push(out)) {
+        lost.fetch_add(1, std::memory_order_relaxed);
+    }
+    return 0xFF;
+}
+
+std::string capture_transport::take() {
+
+    std::string text;
+    uint8_t chunk[256];
+
+    while (size_t count = sent.pop(chunk, sizeof(chunk))) {
+        text.append(reinterpret_cast<const char*>(chunk), count);
+    }
+    return text;
+}
+
+
+file_transport::file_transport(const std::string& path) : file(fopen(path.c_str(), "wb")), owned(true) {
+    if (!file) {
+        std::cout << "Could not open serial output file: " << path << "\n";
+    }
+}
+
+file_transport::~file_transport() {
+    if (file) {
+        fflush(file);
+        if (owned) {
+            fclose(file);
+        }
+    }
+}
+
+uint8_t file_transport::exchange(uint8_t out) {
+    if (file) {
+        fputc(out, file);
+    }
+    return 0xFF;
+}
+
+
+uint8_t peer_transport::exchange(uint8_t out) {
+    return peer.receive(out);
+}
+
+void connect_peers(serial_port& a, serial_port& b) {
+    a.set_transport(std::unique_ptr<serial_transport>(new peer_transport(b)));
+    b.set_transport(std::unique_ptr<serial_transport>(new peer_transport(a)));
+}
+
+
+void serial_port::connect_io() {
+
+    mem.hook_io(0xFF01, [this]() { return SB; }, [this](uint8_t data) { SB = data; });
+
+    mem.hook_io(0xFF02, [this]() { return SC; }, [this](uint8_t data) {
+        SC = data;
+        bool clocked_here = (SC & 0x01) || transport->clocks_external();
+        if ((SC & 0x80) && clocked_here) { //start, internal clock or one the transport provides
+            cycles_left = TRANSFER_CYCLES;
+        } else {
+            cycles_left = 0; //stopped, or waiting on the other side's clock
+        }
+    });
+}
+
+void serial_port::step(int cycles) {
+
+    if (cycles < cycles_left) {
+        cycles_left -= cycles;
+        return;
+    }
+    cycles_left = 0;
+    finish(transport->exchange(SB));
+}
+
+uint8_t serial_port::receive(uint8_t in) {
+
+    uint8_t out = SB;
+
+    if ((SC & 0x81) == 0x80) { //waiting for an external clock, this is it
+        finish(in);
+    } else {
+        SB = in;
+    }
+    return out;
+}
+
+void serial_port::finish(uint8_t in) {
+    SB = in;
+    SC &= ~0x80;
+    mem.request_interrupt(0x08);
+}
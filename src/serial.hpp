@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+class mmu;
+
+//single producer / single consumer byte queue, the emulation thread pushes and
+//one other thread (a test harness, a logger) pops without either side locking
+template<size_t N>
+class byte_ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    public:
+
+        bool push(uint8_t byte) {
+            size_t head = write_index.load(std::memory_order_relaxed);
+            if (head - read_index.load(std::memory_order_acquire) == N) {
+                return false; //full
+            }
+            bytes[head & (N - 1)] = byte;
+            write_index.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        size_t pop(uint8_t* out, size_t max) {
+            size_t tail = read_index.load(std::memory_order_relaxed);
+            size_t count = write_index.load(std::memory_order_acquire) - tail;
+            if (count > max) {
+                count = max;
+            }
+            for (size_t i = 0; i < count; i++) {
+                out[i] = bytes[(tail + i) & (N - 1)];
+            }
+            read_index.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+    private:
+
+        uint8_t bytes[N];
+        std::atomic<size_t> write_index{0};
+        std::atomic<size_t> read_index{0};
+};
+
+
+//the other end of the link cable. exchange is called once per finished transfer
+//with the byte shifted out, and returns the byte shifted in
+class serial_transport {
+    public:
+        virtual ~serial_transport() {}
+        virtual uint8_t exchange(uint8_t out) = 0;
+
+        //true to finish externally clocked transfers after TRANSFER_CYCLES as if the
+        //other side clocked them. off by default, with no cable nothing clocks them and
+        //they never finish
+        virtual bool clocks_external() const { return false; }
+};
+
+//nothing plugged in, the line floats high. a harness can have it clock external
+//transfers too, so a game waiting on a partner gets 0xFF back instead of hanging
+class null_transport : public serial_transport {
+    public:
+
+        null_transport(bool clock_external = false) : clock_external(clock_external){};
+
+        uint8_t exchange(uint8_t) override { return 0xFF; }
+        bool clocks_external() const override { return clock_external; }
+
+    private:
+
+        bool clock_external;
+};
+
+//keeps everything sent for another thread to collect, test roms print their results this way
+class capture_transport : public serial_transport {
+    public:
+
+        uint8_t exchange(uint8_t out) override;
+
+        std::string take(); //everything sent since the last take
+        uint64_t dropped() const { return lost.load(std::memory_order_relaxed); }
+
+    private:
+
+        byte_ring<0x10000> sent;
+        std::atomic<uint64_t> lost{0}; //bytes that found the ring full
+};
+
+//writes what is sent to a file through stdio's buffer, stdout unless told otherwise
+class file_transport : public serial_transport {
+    public:
+
+        file_transport(FILE* out = stdout) : file(out), owned(false){};
+        file_transport(const std::string& path);
+        ~file_transport();
+
+        uint8_t exchange(uint8_t out) override;
+
+    private:
+
+        FILE* file;
+        bool owned;
+};
+
+class serial_port;
+
+//a link cable to another emulator in the same process, driven from the same thread
+class peer_transport : public serial_transport {
+    public:
+
+        peer_transport(serial_port& other) : peer(other){};
+
+        uint8_t exchange(uint8_t out) override;
+
+    private:
+
+        serial_port& peer;
+};
+
+
+//serial port (SB 0xFF01, SC 0xFF02). an internally clocked transfer takes 8 bits at
+//8192 Hz, at the end the byte is swapped with the transport and IF bit 3 is raised.
+//externally clocked transfers wait for a peer to clock them (or for a transport that
+//clocks them itself, see serial_transport::clocks_external)
+class serial_port {
+    public:
+
+        static const int CYCLES_PER_BIT = 512; //4194304 Hz / 8192 Hz
+        static const int TRANSFER_CYCLES = 8 * CYCLES_PER_BIT;
+
+        serial_port(mmu& memory) : mem(memory), transport(new file_transport()){};
+
+        void connect_io();
+        void set_transport(std::unique_ptr<serial_transport> link) { transport = std::move(link); }
+        serial_transport* get_transport() { return transport.get(); }
+
+        void tick(int cycles) { if (cycles_left) step(cycles); }
+        void reset() { SB = SC = 0; cycles_left = 0; } //the transport stays plugged in
+
+        //cycles until the running transfer raises its interrupt, 0 when there is none
+        int cycles_until_interrupt() const { return cycles_left; }
+
+        //a peer clocked a byte in, returns the byte shifted out in exchange
+        uint8_t receive(uint8_t in);
+
+        uint8_t SB = 0;
+        uint8_t SC = 0;
+
+    private:
+
+        mmu& mem;
+        std::unique_ptr<serial_transport> transport;
+        int cycles_left = 0;
+
+        void step(int cycles);
+        void finish(uint8_t in);
+};
+
+//plugs a link cable between two ports
+void connect_peers(serial_port& a, serial_port& b);
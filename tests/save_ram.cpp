@@ -0,0 +1,57 @@
+//save ram tests: two emulators opening the same .sav. the first maps the file, the
+//second has to get its own copy of what was in it and never write back, so the
+//games don't see each other's writes and the file ends up with the first one's.
+//
+//  make save_test && ./save_test
+
+#include "../src/save.hpp"
+
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+static bool check(const char* what, unsigned got, unsigned want) {
+
+    if (got != want) {
+        printf("FAIL %-28s got %02x want %02x\n", what, got, want);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+
+    const size_t SIZE = 0x2000;
+    std::string path = "/tmp/save_test_" + std::to_string(getpid()) + ".sav";
+
+    bool ok = true;
+    {
+        std::unique_ptr<save_ram> first = save_ram::open(path, SIZE);
+        first->data()[0x10] = 0x11;
+        first->mark_dirty(0x10);
+
+        std::unique_ptr<save_ram> second = save_ram::open(path, SIZE);
+        ok &= check("first maps the file", first->persistent(), true);
+        ok &= check("second is not written back", second->persistent(), false);
+        ok &= check("second starts from the file", second->data()[0x10], 0x11);
+
+        first->data()[0x20] = 0x22;
+        first->mark_dirty(0x20);
+        second->data()[0x30] = 0x33;
+        second->mark_dirty(0x30);
+
+        ok &= check("first's write stays in first", second->data()[0x20], 0x00);
+        ok &= check("second's write stays in second", first->data()[0x30], 0x00);
+    }
+    {
+        std::unique_ptr<save_ram> reopened = save_ram::open(path, SIZE);
+        ok &= check("lock released on close", reopened->persistent(), true);
+        ok &= check("file has first's writes", reopened->data()[0x20], 0x22);
+        ok &= check("file lacks second's writes", reopened->data()[0x30], 0x00);
+    }
+
+    unlink(path.c_str());
+
+    printf(ok ? "save ram tests passed\n" : "save ram tests FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+//single step tests: one instruction at a time on the cpu over flat_bus, no mapping
+//or io in the way. each case sets the registers and memory, runs one execute() and
+//checks the registers, the cycles taken and the bytes it should have written.
+//cycles are the ones opcodes.inc gives, a few of which are longer than on hardware.
+//
+//  make single_step_test && ./single_step_test
+
+#include "../src/cpu.hpp"
+
+#include <cstdio>
+#include <vector>
+
+uint8_t g_polled_actions = 0x0F;
+uint8_t g_polled_directions = 0x0F;
+
+typedef basic_cpu<flat_bus> flat_cpu;
+
+struct registers {
+    uint16_t AF, BC, DE, HL, SP, PC;
+};
+
+struct byte_at {
+    uint16_t address;
+    uint8_t value;
+};
+
+struct step_case {
+    const char* name;
+    registers before;
+    std::vector<byte_at> memory;    //program bytes and data
+    registers after;
+    int cycles;
+    std::vector<byte_at> expected;  //memory after the step
+};
+
+static const step_case cases[] = {
+    {"LD A,(HL)",   {0x0000, 0x0000, 0x0000, 0xC100, 0xDFF0, 0xC000}, {{0xC000, 0x7E}, {0xC100, 0x5A}},
+                    {0x5A00, 0x0000, 0x0000, 0xC100, 0xDFF0, 0xC001}, 8, {}},
+    {"LD (HL+),A",  {0x4200, 0x0000, 0x0000, 0xC1FF, 0xDFF0, 0xC000}, {{0xC000, 0x22}},
+                    {0x4200, 0x0000, 0x0000, 0xC200, 0xDFF0, 0xC001}, 8, {{0xC1FF, 0x42}}},
+    {"ADD A,B",     {0x3A00, 0xC600, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0x80}},
+                    {0x00B0, 0xC600, 0x0000, 0x0000, 0xDFF0, 0xC001}, 4, {}},
+    {"SUB n8",      {0x3E00, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0xD6}, {0xC001, 0x0F}},
+                    {0x2F60, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC002}, 8, {}},
+    {"XOR A",       {0x7730, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0xAF}},
+                    {0x0080, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC001}, 4, {}},
+    {"INC B",       {0x0010, 0x0F00, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0x04}},
+                    {0x0030, 0x1000, 0x0000, 0x0000, 0xDFF0, 0xC001}, 4, {}},
+    {"JR NZ taken", {0x0000, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0x20}, {0xC001, 0xFC}},
+                    {0x0000, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xBFFE}, 12, {}},
+    {"JR NZ not",   {0x0080, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0x20}, {0xC001, 0xFC}},
+                    {0x0080, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC002}, 8, {}},
+    {"PUSH BC",     {0x0000, 0x1234, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0xC5}},
+                    {0x0000, 0x1234, 0x0000, 0x0000, 0xDFEE, 0xC001}, 16, {{0xDFEF, 0x12}, {0xDFEE, 0x34}}},
+    {"POP AF",      {0x0000, 0x0000, 0x0000, 0x0000, 0xDFEE, 0xC000}, {{0xC000, 0xF1}, {0xDFEE, 0xFF}, {0xDFEF, 0x99}},
+                    {0x99F0, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC001}, 16, {}},
+    {"CALL n16",    {0x0000, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0xCD}, {0xC001, 0x34}, {0xC002, 0xD2}},
+                    {0x0000, 0x0000, 0x0000, 0x0000, 0xDFEE, 0xD234}, 24, {{0xDFEF, 0xC0}, {0xDFEE, 0x03}}},
+    {"RET",         {0x0000, 0x0000, 0x0000, 0x0000, 0xDFEE, 0xC000}, {{0xC000, 0xC9}, {0xDFEE, 0x03}, {0xDFEF, 0xC0}},
+                    {0x0000, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC003}, 16, {}},
+    {"SWAP A",      {0xF100, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC000}, {{0xC000, 0xCB}, {0xC001, 0x37}},
+                    {0x1F00, 0x0000, 0x0000, 0x0000, 0xDFF0, 0xC002}, 12, {}},
+};
+
+static bool check(const char* name, const char* what, unsigned got, unsigned want) {
+
+    if (got != want) {
+        printf("FAIL %-12s %-6s got %04x want %04x\n", name, what, got, want);
+        return false;
+    }
+    return true;
+}
+
+static bool run_case(flat_cpu& gb, const step_case& test) {
+
+    gb.reset();
+    gb.IME = false;
+
+    for (const byte_at& poke : test.memory) {
+        gb.bus().ld(poke.value, poke.address);
+    }
+    gb.AF = test.before.AF;
+    gb.BC = test.before.BC;
+    gb.DE = test.before.DE;
+    gb.HL = test.before.HL;
+    gb.SP = test.before.SP;
+    gb.PC = test.before.PC;
+
+    int cycles = gb.execute();
+    gb.flush_flags();
+
+    bool ok = check(test.name, "AF", gb.AF, test.after.AF);
+    ok &= check(test.name, "BC", gb.BC, test.after.BC);
+    ok &= check(test.name, "DE", gb.DE, test.after.DE);
+    ok &= check(test.name, "HL", gb.HL, test.after.HL);
+    ok &= check(test.name, "SP", gb.SP, test.after.SP);
+    ok &= check(test.name, "PC", gb.PC, test.after.PC);
+    ok &= check(test.name, "cycles", cycles, test.cycles);
+
+    for (const byte_at& expected : test.expected) {
+        ok &= check(test.name, "memory", gb.bus().rd(expected.address), expected.value);
+    }
+    return ok;
+}
+
+//a rom inserted into the flat bus lands at 0x0000 and runs from there
+static bool run_from_rom(flat_cpu& gb) {
+
+    std::vector<uint8_t> rom(0x150, 0x00);
+    rom[0x100] = 0x3E; rom[0x101] = 0x77; //LD A,0x77
+
+    gb.bus().insert_cartridge(rom_image::from_bytes(rom));
+    gb.fast_boot = true;
+    gb.reset();
+    gb.IME = false;
+
+    gb.execute();
+    bool ok = check("rom", "A", gb.get_A(), 0x77) & check("rom", "PC", gb.PC, 0x0102);
+
+    gb.fast_boot = false;
+    gb.bus().insert_cartridge(rom_image::blank());
+    return ok;
+}
+
+int main() {
+
+    flat_cpu* gb = new flat_cpu(flat_bus());
+
+    int failed = 0;
+    for (const step_case& test : cases) {
+        failed += !run_case(*gb, test);
+    }
+    failed += !run_from_rom(*gb);
+
+    int total = sizeof(cases) / sizeof(cases[0]) + 1;
+    printf("%d of %d single step tests passed\n", total - failed, total);
+
+    delete gb;
+    return failed ? 1 : 0;
+}